@@ -0,0 +1,21 @@
+# ifndef MEM_DUMP_H
+# define MEM_DUMP_H
+
+# include <stdint.h>
+
+//--dump-mem output of risc_v_vm, read back by perform_tests. The header is
+//followed by one index entry per dirty page and then the contents of the
+//pages in the same order
+typedef struct mem_dump_header_t{
+    char magic[4]; // "RVMD"
+    uint32_t page_size;
+    uint32_t page_count;
+}mem_dump_header_t;
+
+typedef struct mem_dump_entry_t{
+    uint32_t page; // page number, address / page_size
+    uint32_t reserved;
+    uint64_t hash;
+}mem_dump_entry_t;
+
+# endif
@@ -6,13 +6,20 @@
 # include <sys/stat.h>
 # include <sys/types.h>
 # include <dirent.h>
+# include <unistd.h>
+# include <signal.h>
+# include <sys/wait.h>
+# include <sys/socket.h>
+# include <sys/un.h>
+# include "mem_dump.h"
 
 # define DEBUG(...) do{if(debug){fprintf(stderr, __VA_ARGS__);}}while(0);
 
-
-
 bool is_binary(char *fileName);
 char ** get_bin_files(int *size);
+bool compare_mem_files(char *golden_file);
+bool compare_bin_files(char *input_file, char *vm_out_file, long offset);
+bool run_gdb_script(char *run_vm_command, char *gdb_file);
 int debug = 1;
 
 void get_res_file(char *bin_file){
@@ -20,9 +27,63 @@ void get_res_file(char *bin_file){
     memcpy(strrchr_out, ".res", 4);
 }
 
+bool get_mem_file(char *bin_file, char *mem_file, size_t size){
+    //golden memory dump for bin_file, true if the task has one
+    snprintf(mem_file, size, "%s", bin_file);
+    char * strrchr_out = strrchr(mem_file, '.');
+    memcpy(strrchr_out, ".mem", 4);
+    FILE *fp = fopen(mem_file, "rb");
+    if(fp == NULL){
+        return false;
+    }
+    fclose(fp);
+    return true;
+}
+
+bool get_gdb_file(char *bin_file, char *gdb_file, size_t size){
+    //gdb packet script for bin_file, true if the task has one
+    snprintf(gdb_file, size, "%s", bin_file);
+    char * strrchr_out = strrchr(gdb_file, '.');
+    memcpy(strrchr_out, ".gdb", 4);
+    FILE *fp = fopen(gdb_file, "r");
+    if(fp == NULL){
+        return false;
+    }
+    fclose(fp);
+    return true;
+}
+
+bool get_args_file(char *bin_file, char *args, size_t size){
+    //extra vm arguments for bin_file, placed after it on the command line.
+    //true if the task has a *.args file
+    char args_file[100];
+    snprintf(args_file, sizeof(args_file), "%s", bin_file);
+    char * strrchr_out = strrchr(args_file, '.');
+    snprintf(strrchr_out, sizeof(args_file) - (strrchr_out - args_file), ".args");
+    FILE *fp = fopen(args_file, "r");
+    if(fp == NULL){
+        return false;
+    }
+    if(fgets(args, size, fp) == NULL){
+        args[0] = '\0';
+    }
+    args[strcspn(args, "\n")] = '\0';
+    fclose(fp);
+    return true;
+}
+
+int count_lanes(char *res_file){
+    //a batch task has one register file per lane in its *.res file
+    struct stat st;
+    if(stat(res_file, &st) != 0){
+        perror("[count_lanes]res_file stat error");
+        exit(1);
+    }
+    return st.st_size / (32 * 4);
+}
 
-bool compare_bin_files(char *input_file){
-    //compares the result from the task with the output generated from the vm
+bool compare_bin_files(char *input_file, char *vm_out_file, long offset){
+    //compares the result from the task at offset with the output generated from the vm
     bool result = true; 
     size_t file_size = 32 * 4; //assumes this file size
 
@@ -33,10 +94,14 @@ bool compare_bin_files(char *input_file){
         exit(1);
     }
 
-    FILE * fp_vm_out = fopen("vm_out.res", "rb");
-    if(fp_vm_out == NULL){
-        perror("[compare_bin_files]reg_out.bin open error");
+    FILE * fp_vm_out = fopen(vm_out_file, "rb");
+    if(fp_vm_out == NULL){ //the vm crashed before writing its registers
+        DEBUG("[compare_bin_files]%s missing\n", vm_out_file);
         fclose(fp_input_file);
+        return false;
+    }
+    if(fseek(fp_input_file, offset, SEEK_SET) != 0){
+        perror("[compare_bin_files]input_file seek error");
         exit(1);
     }
 
@@ -64,6 +129,202 @@ bool compare_bin_files(char *input_file){
 return result;
 }
 
+bool compare_mem_files(char *golden_file){
+    //compares the dirty pages of two memory dumps, pages are compared by
+    //hash first and byte by byte only when the hashes differ
+    bool result = true;
+    mem_dump_header_t header1, header2;
+
+    FILE * fp_golden = fopen(golden_file, "rb");
+    if(fp_golden == NULL){
+        perror("[compare_mem_files]golden_file open error");
+        exit(1);
+    }
+
+    FILE * fp_vm_out = fopen("vm_out.mem", "rb");
+    if(fp_vm_out == NULL){
+        DEBUG("[compare_mem_files]vm_out.mem missing\n");
+        fclose(fp_golden);
+        return false;
+    }
+
+    if(fread(&header1, sizeof(header1), 1, fp_golden) != 1 ||
+       fread(&header2, sizeof(header2), 1, fp_vm_out) != 1 ||
+       memcmp(header1.magic, "RVMD", 4) != 0 || memcmp(header2.magic, "RVMD", 4) != 0){
+        DEBUG("[compare_mem_files]bad memory dump header\n");
+        fclose(fp_golden);
+        fclose(fp_vm_out);
+        return false;
+    }
+    if(header1.page_size != header2.page_size || header1.page_count != header2.page_count){
+        DEBUG("[compare_mem_files]%u dirty pages expected, got %u\n", header1.page_count, header2.page_count);
+        fclose(fp_golden);
+        fclose(fp_vm_out);
+        return false;
+    }
+
+    uint32_t count = header1.page_count;
+    uint32_t page_size = header1.page_size;
+    mem_dump_entry_t *index1 = calloc(count + 1, sizeof(mem_dump_entry_t));
+    mem_dump_entry_t *index2 = calloc(count + 1, sizeof(mem_dump_entry_t));
+    uint8_t *page1 = malloc(page_size);
+    uint8_t *page2 = malloc(page_size);
+    if(index1 == NULL || index2 == NULL || page1 == NULL || page2 == NULL){
+        perror("[compare_mem_files]Malloc error");
+        exit(1);
+    }
+
+    if(fread(index1, sizeof(mem_dump_entry_t), count, fp_golden) != count ||
+       fread(index2, sizeof(mem_dump_entry_t), count, fp_vm_out) != count){
+        perror("[compare_mem_files]:index read error");
+        exit(1);
+    }
+
+    long data_start = sizeof(mem_dump_header_t) + (long)count * sizeof(mem_dump_entry_t);
+    for(uint32_t entry = 0; entry < count; entry++){
+        if(index1[entry].page != index2[entry].page){
+            DEBUG("[compare_mem_files]page %#x expected, got page %#x\n",
+                  index1[entry].page * page_size, index2[entry].page * page_size);
+            result = false;
+            break;
+        }
+        if(index1[entry].hash == index2[entry].hash){
+            continue;
+        }
+
+        //hash mismatch, find the first differing byte
+        long offset = data_start + (long)entry * page_size;
+        if(fseek(fp_golden, offset, SEEK_SET) != 0 || fseek(fp_vm_out, offset, SEEK_SET) != 0 ||
+           fread(page1, 1, page_size, fp_golden) != page_size ||
+           fread(page2, 1, page_size, fp_vm_out) != page_size){
+            perror("[compare_mem_files]:page read error");
+            exit(1);
+        }
+        for(uint32_t byte = 0; byte < page_size; byte++){
+            if(page1[byte] != page2[byte]){
+                DEBUG("[compare_mem_files]address %#x expected 0x%02x, got 0x%02x\n",
+                      index1[entry].page * page_size + byte, page1[byte], page2[byte]);
+                result = false;
+                break;
+            }
+        }
+    }
+
+    free(index1);
+    free(index2);
+    free(page1);
+    free(page2);
+    fclose(fp_golden);
+    fclose(fp_vm_out);
+return result;
+}
+
+bool gdb_exchange(int fd, char *packet, char *reply, size_t size){
+    //sends one remote protocol packet and reads the reply, the '+' acks are skipped
+    char buffer[600];
+    unsigned int checksum = 0;
+    for(char *c = packet; *c != '\0'; c++){
+        checksum += (unsigned char)*c;
+    }
+    int length = snprintf(buffer, sizeof(buffer), "$%s#%02x", packet, checksum & 0xFF);
+    if(send(fd, buffer, length, MSG_NOSIGNAL) != length){ //the vm may already be gone
+        return false;
+    }
+
+    size_t used = 0;
+    char c;
+    bool started = false;
+    int tail = -1; //checksum characters left after '#'
+    while(tail != 0 && read(fd, &c, 1) == 1){
+        if(!started){
+            started = (c == '$');
+        }
+        else if(tail > 0){
+            tail--;
+        }
+        else if(c == '#'){
+            tail = 2;
+        }
+        else if(used + 1 < size){
+            reply[used++] = c;
+        }
+    }
+    reply[used] = '\0';
+    send(fd, "+", 1, MSG_NOSIGNAL); //the vm closes the socket after the reply to D
+    return tail == 0;
+}
+
+bool run_gdb_script(char *run_vm_command, char *gdb_file){
+    //starts the vm waiting for gdb on a unix socket and sends the packets of
+    //gdb_file, one per line followed by the expected reply. A reply ending in
+    //'*' only has to match up to it
+    const char *socket_path = "vm_gdb.sock";
+    char command[500];
+    char line[500];
+    char reply[500];
+    bool result = true;
+
+    FILE *fp = fopen(gdb_file, "r");
+    if(fp == NULL){
+        perror("[run_gdb_script]gdb_file open error");
+        exit(1);
+    }
+    unlink(socket_path);
+    snprintf(command, sizeof(command), "exec %s --gdb=unix:%s 2>/dev/null", run_vm_command, socket_path); //exec, so pid is the vm
+    pid_t pid = fork();
+    if(pid == -1){
+        perror("[run_gdb_script]fork error");
+        exit(1);
+    }
+    if(pid == 0){
+        execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+        _exit(127);
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0x00, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    bool connected = false;
+    for(int retry = 0; fd != -1 && !connected && retry < 200; retry++){ //the vm needs a moment to listen
+        connected = connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        if(!connected){
+            usleep(10000);
+        }
+    }
+    if(!connected){
+        DEBUG("[run_gdb_script]could not connect to %s\n", socket_path);
+        kill(pid, SIGKILL);
+        result = false;
+    }
+
+    while(result && fgets(line, sizeof(line), fp) != NULL){
+        line[strcspn(line, "\n")] = '\0';
+        char *expected = strchr(line, ' ');
+        if(expected == NULL){
+            continue;
+        }
+        *expected++ = '\0';
+        size_t length = strlen(expected);
+        bool prefix = (length > 0 && expected[length - 1] == '*');
+        if(!gdb_exchange(fd, line, reply, sizeof(reply)) ||
+           (prefix ? strncmp(reply, expected, length - 1) : strcmp(reply, expected)) != 0){
+            DEBUG("[run_gdb_script]%s: expected %s, got %s\n", line, expected, reply);
+            kill(pid, SIGKILL);
+            result = false;
+        }
+    }
+
+    if(fd != -1){
+        close(fd);
+    }
+    fclose(fp);
+    waitpid(pid, NULL, 0);
+    unlink(socket_path);
+    return result;
+}
+
 int main(int argc, char *argv[]){
 
     if(argc != 2){
@@ -73,20 +334,59 @@ int main(int argc, char *argv[]){
     int size = 0;
     char ** bin_files = get_bin_files(&size);
     char * current_file;
-    int max_size = 40;
-    char run_vm_command[max_size];
+    int max_size = 100;
+    char run_vm_command[4 * max_size];
+    char mem_file[max_size];
+    char gdb_file[max_size];
+    char args[2 * max_size];
+    char vm_out_file[max_size];
 
 
     for(int index = 0; index < size; index++){
         memset(run_vm_command, 0x00, sizeof(run_vm_command));
 
         current_file = bin_files[index];
-        snprintf(run_vm_command, sizeof(run_vm_command), "./%s %s", argv[1], current_file);
-        system(run_vm_command);
+        bool check_mem = get_mem_file(current_file, mem_file, sizeof(mem_file));
+        bool check_gdb = get_gdb_file(current_file, gdb_file, sizeof(gdb_file));
+        if(!get_args_file(current_file, args, sizeof(args))){
+            args[0] = '\0';
+        }
+        snprintf(run_vm_command, sizeof(run_vm_command), "./%s %s%s %s", argv[1],
+                 check_mem ? "--dump-mem " : "", current_file, args);
+        //batch tasks write vm_out_<lane>.res instead of vm_out.res
+        bool batch = strstr(args, "--batch=") != NULL;
 
         //printf("before get_res_file: %s\n", current_file);
         get_res_file(current_file);
-        bool result = compare_bin_files(current_file);
+        int lanes = batch ? count_lanes(current_file) : 1;
+
+        //a run that crashes must not be compared with the output of the previous one
+        remove("vm_out.res");
+        remove("vm_out.mem");
+        for(int lane = 0; batch && lane < lanes; lane++){
+            snprintf(vm_out_file, sizeof(vm_out_file), "vm_out_%d.res", lane);
+            remove(vm_out_file);
+        }
+        bool result = true;
+        if(check_gdb){
+            result = run_gdb_script(run_vm_command, gdb_file);
+        }
+        else{
+            system(run_vm_command);
+        }
+
+        for(int lane = 0; lane < lanes; lane++){
+            if(batch){
+                snprintf(vm_out_file, sizeof(vm_out_file), "vm_out_%d.res", lane);
+            }
+            else{
+                snprintf(vm_out_file, sizeof(vm_out_file), "vm_out.res");
+            }
+            result = compare_bin_files(current_file, vm_out_file, lane * 32 * 4) && result;
+        }
+        if(check_mem){
+            result = compare_mem_files(mem_file) && result;
+        }
         printf("%-20s %s\n", current_file, result ? "passed": "failed");
     }
 
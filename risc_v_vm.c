@@ -1,4 +1,5 @@
 # define _POSIX_C_SOURCE 200809L
+# define _DEFAULT_SOURCE // MAP_ANONYMOUS
 
 # include <stdio.h>
 # include <stdlib.h>
@@ -6,6 +7,24 @@
 # include <string.h>
 # include <stdbool.h>
 # include <sys/stat.h>
+# include <sys/mman.h>
+# include <fcntl.h>
+# include <unistd.h>
+# include <time.h>
+# include <math.h>
+# include <fenv.h>
+# include <signal.h>
+# include <sys/socket.h>
+# include <sys/un.h>
+# include <netinet/in.h>
+# include "mem_dump.h"
+
+//the F and D instructions change the host rounding mode and read its flags,
+//so FP code must not be moved across fesetround. GCC ignores the pragma and
+//needs -frounding-math instead, see the build line in README.md
+# if defined(__clang__) || !defined(__GNUC__)
+# pragma STDC FENV_ACCESS ON
+# endif
 
 //reference card
 // https://www.cs.sfu.ca/~ashriram/Courses/CS295/assets/notebooks/RISCV/RISCV_CARD.pdf
@@ -13,13 +32,138 @@
 # define PC_REG 32
 # define REG_ZERO 0
 
-# define mem_size (1<<20)
+# ifndef mem_size
+# define mem_size (1<<20) // can be raised with -Dmem_size=... for bigger host maps
+# endif
+# define MAX_HOST_MAPS 8
+# define PAGE_SHIFT 12
+# define PAGE_SIZE (1 << PAGE_SHIFT)
+# define MEM_PAGES (mem_size / PAGE_SIZE)
+# define PAGE_MASK (~(uint32_t)(PAGE_SIZE - 1))
+# define TLB_SIZE 256 // entries per access type, direct mapped on the virtual page number
+# define GDB_PACKET_SIZE 4096
+# define GDB_MAX_BREAKPOINTS 64
+# define GDB_MAX_WATCHPOINTS 16
+# define EBREAK 0x00100073
+# ifndef VLEN
+# define VLEN 128 // vector register bits, 128 or 256, set with -DVLEN=256
+# endif
+# define VLENB (VLEN / 8)
+# define BATCH_WIDTH 16 // lanes per host vector, 16 x 32 bit fills one AVX-512 register
+# define BATCH_STRIDE (mem_size + 64) // lane memories are one cache line off a power of two, so one address in all lanes spreads over the cache sets
 # define REG(x) vm->registers[x]
 # define PC vm.registers[32]
 
 # define MASK_3_BIT 0x07 // funct3
 # define MASK_5_BIT 0x1F // register bits
 # define MASK_7_BIT 0x7F // opcode bits and funct7
+# define MASK_12_BIT 0xFFF // csr address
+
+//Zicsr counter addresses
+# define CSR_CYCLE 0xC00
+# define CSR_TIME 0xC01
+# define CSR_INSTRET 0xC02
+# define CSR_CYCLEH 0xC80
+# define CSR_TIMEH 0xC81
+# define CSR_INSTRETH 0xC82
+# define CSR_FFLAGS 0x001
+# define CSR_FRM 0x002
+# define CSR_FCSR 0x003
+# define CSR_VSTART 0x008
+# define CSR_VL 0xC20
+# define CSR_VTYPE 0xC21
+# define CSR_VLENB 0xC22
+# define VTYPE_VILL 0x80000000u
+# define CSR_SSTATUS 0x100
+# define CSR_SIE 0x104
+# define CSR_STVEC 0x105
+# define CSR_SCOUNTEREN 0x106
+# define CSR_SSCRATCH 0x140
+# define CSR_SEPC 0x141
+# define CSR_SCAUSE 0x142
+# define CSR_STVAL 0x143
+# define CSR_SIP 0x144
+# define CSR_SATP 0x180
+# define CSR_MSTATUS 0x300
+# define CSR_MISA 0x301
+# define CSR_MEDELEG 0x302
+# define CSR_MIDELEG 0x303
+# define CSR_MIE 0x304
+# define CSR_MTVEC 0x305
+# define CSR_MCOUNTEREN 0x306
+# define CSR_MSTATUSH 0x310
+# define CSR_MSCRATCH 0x340
+# define CSR_MEPC 0x341
+# define CSR_MCAUSE 0x342
+# define CSR_MTVAL 0x343
+# define CSR_MIP 0x344
+# define CSR_MVENDORID 0xF11
+# define CSR_MARCHID 0xF12
+# define CSR_MIMPID 0xF13
+# define CSR_MHARTID 0xF14
+
+//privilege modes
+# define PRIV_U 0
+# define PRIV_S 1
+# define PRIV_M 3
+
+# define MSTATUS_SIE (1u << 1)
+# define MSTATUS_MIE (1u << 3)
+# define MSTATUS_SPIE (1u << 5)
+# define MSTATUS_MPIE (1u << 7)
+# define MSTATUS_SPP (1u << 8)
+# define MSTATUS_MPP (3u << 11)
+# define MSTATUS_FS (3u << 13) // stored only, the FPU is always on
+# define MSTATUS_MPRV (1u << 17)
+# define MSTATUS_SUM (1u << 18)
+# define MSTATUS_MXR (1u << 19)
+# define MSTATUS_TVM (1u << 20)
+# define MSTATUS_TW (1u << 21)
+# define MSTATUS_TSR (1u << 22)
+# define SSTATUS_MASK (MSTATUS_SIE | MSTATUS_SPIE | MSTATUS_SPP | MSTATUS_FS | MSTATUS_SUM | MSTATUS_MXR)
+# define MSTATUS_MASK (SSTATUS_MASK | MSTATUS_MIE | MSTATUS_MPIE | MSTATUS_MPP | MSTATUS_MPRV | \
+                       MSTATUS_TVM | MSTATUS_TW | MSTATUS_TSR)
+//bits that change how loads and stores are translated
+# define MSTATUS_TRANSLATION (MSTATUS_MPP | MSTATUS_MPRV | MSTATUS_SUM | MSTATUS_MXR)
+
+# define MIP_SSIP (1u << 1)
+# define MIP_MSIP (1u << 3)
+# define MIP_STIP (1u << 5)
+# define MIP_MTIP (1u << 7)
+# define MIP_SEIP (1u << 9)
+# define MIP_MEIP (1u << 11)
+# define MIP_S_MASK (MIP_SSIP | MIP_STIP | MIP_SEIP)
+# define MIP_MASK (MIP_S_MASK | MIP_MSIP | MIP_MTIP | MIP_MEIP)
+
+# define MISA_RV32 ((1u << 30) | (1u << ('I' - 'A')) | (1u << ('F' - 'A')) | (1u << ('D' - 'A')) | \
+                    (1u << ('V' - 'A')) | (1u << ('S' - 'A')) | (1u << ('U' - 'A')))
+
+# define CAUSE_INTERRUPT 0x80000000u
+# define CAUSE_ILLEGAL_INSTRUCTION 2
+# define CAUSE_BREAKPOINT 3
+# define CAUSE_USER_ECALL 8 // + privilege mode of the caller
+
+# define SATP_MODE 0x80000000u // Sv32 when set, bare otherwise
+# define SATP_PPN 0x003FFFFFu
+
+# define PTE_V 0x01
+# define PTE_R 0x02
+# define PTE_W 0x04
+# define PTE_X 0x08
+# define PTE_U 0x10
+# define PTE_A 0x40
+# define PTE_D 0x80
+
+//fflags bits
+# define FFLAG_NX 0x01 // inexact
+# define FFLAG_UF 0x02 // underflow
+# define FFLAG_OF 0x04 // overflow
+# define FFLAG_DZ 0x08 // divide by zero
+# define FFLAG_NV 0x10 // invalid operation
+
+# define CANONICAL_NAN_S 0x7fc00000u
+# define CANONICAL_NAN_D 0x7ff8000000000000ull
+# define NAN_BOX 0xffffffff00000000ull // upper half of a single in a 64 bit register
 
 int debug_ins = 0;
 int debug_regs = 0;
@@ -39,26 +183,196 @@ typedef struct instruction_t{
     uint16_t rd;
     uint16_t funct3;
     uint16_t funct7;
-    uint16_t f7_index; //for array indexing
+    uint16_t f7_index; //for array indexing, fmt for floating point
+    uint16_t rs3; //fused multiply add
     int32_t imm;
     char *name;
 }instruction_t;
 
+//one translation, the host address of a guest address in the page is addend + address.
+//tag is the page address, an unused entry has low bits set so it never matches
+typedef struct tlb_entry_t{
+    uint32_t tag;
+    uintptr_t addend;
+}tlb_entry_t;
+
+enum{ACCESS_FETCH, ACCESS_LOAD, ACCESS_STORE};
+
 typedef struct vm_t{
     uint8_t *disk;
     bool running;
     uint32_t registers[33]; //one additinal reg for PC
-    uint8_t memory[mem_size];
+    uint8_t *memory; // mem_size bytes, mmap'ed so host files can be mapped into it
     bool branch; // true when next PC != PC + 4
+    uint64_t instret; // instructions retired before block_start
+    uint32_t block_start; // PC of the first instruction in the current block
+    struct timespec start_time; // host time at power on, base for the time CSR
+    uint64_t fregisters[32]; // singles are NaN boxed in the low 32 bits
+    uint32_t fflags; // accrued exceptions, host flags are added when read
+    uint32_t frm; // dynamic rounding mode
+    int host_round; // rounding mode currently set on the host FPU
+    uint8_t vregisters[32 * VLENB] __attribute__((aligned(VLENB))); // groups of LMUL registers are contiguous
+    uint32_t vl;
+    uint32_t vtype;
+    uint32_t vstart;
+    uint8_t dirty[MEM_PAGES]; // pages written since power on, marked when a store fills its TLB entry
+    tlb_entry_t tlb[3][TLB_SIZE]; // fetch, load and store translations
+    int priv; // current privilege mode
+    uint32_t mstatus; // sstatus is a view of the S bits
+    uint32_t medeleg;
+    uint32_t mideleg;
+    uint32_t mie; // sie and sip are views of the delegated bits
+    uint32_t mip;
+    uint32_t mtvec;
+    uint32_t mscratch;
+    uint32_t mepc;
+    uint32_t mcause;
+    uint32_t mtval;
+    uint32_t stvec;
+    uint32_t sscratch;
+    uint32_t sepc;
+    uint32_t scause;
+    uint32_t stval;
+    uint32_t satp;
+    int stop; // why a debugger stopped the machine, STOP_NONE when the program exited
+    uint32_t watch_address; // address that hit a watchpoint
+    int watch_type; // and its Z packet type
 }vm_t;
 
+enum{STOP_NONE, STOP_BREAKPOINT, STOP_STEP, STOP_WATCH, STOP_INTERRUPT};
+
+typedef struct gdb_breakpoint_t{
+    uint32_t address; // virtual, as gdb sees it
+    uint32_t physical; // where the ebreak is written in the fetch copy
+}gdb_breakpoint_t;
+
+typedef struct gdb_code_page_t{
+    uint32_t page; // physical page number with breakpoints
+    bool stale; // memory changed since the copy was made
+    uint8_t code[PAGE_SIZE]; // what fetches see, ebreak over every breakpoint
+}gdb_code_page_t;
+
+typedef struct gdb_watchpoint_t{
+    uint32_t address;
+    uint32_t length;
+    int type; // 2 write, 3 read, 4 access, as in the Z packet
+}gdb_watchpoint_t;
+
+typedef struct host_map_t{
+    char *path;
+    uint32_t address; // guest physical address, page aligned
+    uint32_t size;
+    uint32_t span; // size rounded up to whole host pages, the part of memory the file covers
+    bool writable; // output region, written back to the host file at exit
+}host_map_t;
+
+//batch mode runs many instances of one image in lockstep, the registers are
+//stored struct of arrays so one host vector op executes an instruction for
+//BATCH_WIDTH instances
+typedef uint32_t lanes_u32 __attribute__((vector_size(BATCH_WIDTH * sizeof(uint32_t))));
+typedef int32_t lanes_s32 __attribute__((vector_size(BATCH_WIDTH * sizeof(int32_t))));
+
+typedef struct batch_t{
+    int lanes; // number of instances
+    int chunks; // host vectors per register, lanes rounded up to BATCH_WIDTH
+    lanes_u32 *registers; // [33][chunks], PC in row 32, UINT32_MAX when halted
+    lanes_u32 *active; // [chunks], all ones for lanes executing this step
+    int chunk_begin; // the active lanes are all in chunks [chunk_begin, chunk_end)
+    int chunk_end;
+    uint8_t *memory; // chunks * BATCH_WIDTH * BATCH_STRIDE, one private memory per lane
+    instruction_t *decoded; // [mem_size / 4], opcode 0 when the word is not decoded yet
+    bool branch; // true when the instruction wrote the PC of the active lanes
+}batch_t;
+
+# define LANES(r, c) batch->registers[(r) * batch->chunks + (c)]
+# define LANE(r, l) ((uint32_t *)&LANES(r, 0))[l]
+# define LANE_ACTIVE(l) ((uint32_t *)batch->active)[l]
+
 typedef int(*i_opcodes)(vm_t *vm, instruction_t *ins);
 typedef int (*r_opcodes)(vm_t *vm, instruction_t *ins);
 typedef int(* U_instruction)(vm_t *, instruction_t*);
 typedef int(*branch_operations)(vm_t *, instruction_t *);
 typedef int(*load_operations)(vm_t*, instruction_t*);
 typedef int (*s_type_ins)(vm_t*, instruction_t*);
-
+typedef int (*csr_operations)(vm_t*, instruction_t*);
+typedef int (*batch_operations)(batch_t*, instruction_t*);
+typedef int (*fp_operations)(vm_t*, instruction_t*);
+typedef int (*v_operations)(vm_t*, instruction_t*);
+
+//one host vector holds one vector register, the element type follows SEW
+typedef uint8_t vreg_u8 __attribute__((vector_size(VLENB)));
+typedef int8_t vreg_s8 __attribute__((vector_size(VLENB)));
+typedef uint16_t vreg_u16 __attribute__((vector_size(VLENB)));
+typedef int16_t vreg_s16 __attribute__((vector_size(VLENB)));
+typedef uint32_t vreg_u32 __attribute__((vector_size(VLENB)));
+typedef int32_t vreg_s32 __attribute__((vector_size(VLENB)));
+typedef uint64_t vreg_u64 __attribute__((vector_size(VLENB)));
+typedef int64_t vreg_s64 __attribute__((vector_size(VLENB)));
+
+//host file mappings
+bool parse_host_map(char *arg, bool writable);
+void map_host_files(vm_t *vm, long signed image_size);
+void unmap_host_files(vm_t *vm);
+void sync_host_files(void);
+bool host_map_read_only(uint64_t physical);
+//batch mode
+void run_batch(uint8_t *disk, long signed size, char **inputs, int lanes, uint32_t input_address);
+void batch_step(batch_t *batch, instruction_t *ins);
+uint8_t *lane_memory(batch_t *batch, int lane, uint32_t address, int size);
+void batch_address(batch_t *batch, instruction_t *ins, int size, int c, lanes_u32 *address);
+int batch_add(batch_t *batch, instruction_t *ins);
+int batch_sub(batch_t *batch, instruction_t *ins);
+int batch_xor(batch_t *batch, instruction_t *ins);
+int batch_or(batch_t *batch, instruction_t *ins);
+int batch_and(batch_t *batch, instruction_t *ins);
+int batch_sll(batch_t *batch, instruction_t *ins);
+int batch_srl(batch_t *batch, instruction_t *ins);
+int batch_sra(batch_t *batch, instruction_t *ins);
+int batch_slt(batch_t *batch, instruction_t *ins);
+int batch_sltu(batch_t *batch, instruction_t *ins);
+int batch_addi(batch_t *batch, instruction_t *ins);
+int batch_xori(batch_t *batch, instruction_t *ins);
+int batch_ori(batch_t *batch, instruction_t *ins);
+int batch_andi(batch_t *batch, instruction_t *ins);
+int batch_slli(batch_t *batch, instruction_t *ins);
+int batch_srli(batch_t *batch, instruction_t *ins);
+int batch_srai(batch_t *batch, instruction_t *ins);
+int batch_slti(batch_t *batch, instruction_t *ins);
+int batch_sltiu(batch_t *batch, instruction_t *ins);
+int batch_beq(batch_t *batch, instruction_t *ins);
+int batch_bne(batch_t *batch, instruction_t *ins);
+int batch_blt(batch_t *batch, instruction_t *ins);
+int batch_bge(batch_t *batch, instruction_t *ins);
+int batch_bltu(batch_t *batch, instruction_t *ins);
+int batch_bgeu(batch_t *batch, instruction_t *ins);
+int batch_lui(batch_t *batch, instruction_t *ins);
+int batch_auipc(batch_t *batch, instruction_t *ins);
+int batch_jal(batch_t *batch, instruction_t *ins);
+int batch_jalr(batch_t *batch, instruction_t *ins);
+int batch_load(batch_t *batch, instruction_t *ins);
+int batch_store(batch_t *batch, instruction_t *ins);
+int batch_ecall(batch_t *batch, instruction_t *ins);
+//gdb remote serial protocol
+void gdb_serve(vm_t *vm, instruction_t *ins);
+int gdb_open(char *address);
+char *gdb_read_packet(void);
+void gdb_send_packet(const char *data);
+void gdb_resume(vm_t *vm, instruction_t *ins, bool single_step);
+void gdb_set_pc(vm_t *vm, uint32_t pc);
+void gdb_stop_reply(vm_t *vm, char *reply);
+void gdb_memory(vm_t *vm, char *packet, char *reply);
+void gdb_set_point(vm_t *vm, char *packet, char *reply);
+void gdb_swap_tables(void);
+bool gdb_watch_hit(vm_t *vm, uint32_t address, uint32_t length, bool write);
+int watched_load(vm_t *vm, instruction_t *ins);
+int watched_store(vm_t *vm, instruction_t *ins);
+int watched_fp_load(vm_t *vm, instruction_t *ins);
+int watched_fp_store(vm_t *vm, instruction_t *ins);
+void gdb_sigio(int signal);
+bool gdb_code_page(vm_t *vm, uint32_t physical, int access, uint8_t **page);
+//memory dumps
+void write_memory_dump(vm_t *vm);
+uint64_t page_hash(const uint8_t *page);
 //debug functions
 void print_mem(vm_t *vm, int address, int size);
 void print_registers(vm_t *vm);
@@ -80,6 +394,7 @@ int sb(vm_t *vm, instruction_t *ins);
 int sh(vm_t *vm, instruction_t *ins);
 int sw(vm_t *vm, instruction_t *ins);
 int ecall(vm_t *vm);
+int ebreak(vm_t *vm);
 int jalr(vm_t *vm, instruction_t *ins);
 int jal(vm_t *vm, instruction_t *ins);
 int addi(vm_t *vm, instruction_t *ins);
@@ -104,6 +419,101 @@ int blt(vm_t *vm, instruction_t *ins);
 int bge(vm_t *vm, instruction_t *ins);
 int bltu(vm_t *vm, instruction_t *ins);
 int bgeu(vm_t *vm, instruction_t *ins);
+int csrrw(vm_t *vm, instruction_t *ins);
+int csrrs(vm_t *vm, instruction_t *ins);
+int csrrc(vm_t *vm, instruction_t *ins);
+int csrrwi(vm_t *vm, instruction_t *ins);
+int csrrsi(vm_t *vm, instruction_t *ins);
+int csrrci(vm_t *vm, instruction_t *ins);
+//floating point
+int flw(vm_t *vm, instruction_t *ins);
+int fld(vm_t *vm, instruction_t *ins);
+int fsw(vm_t *vm, instruction_t *ins);
+int fsd(vm_t *vm, instruction_t *ins);
+int fadd_s(vm_t *vm, instruction_t *ins);
+int fadd_d(vm_t *vm, instruction_t *ins);
+int fsub_s(vm_t *vm, instruction_t *ins);
+int fsub_d(vm_t *vm, instruction_t *ins);
+int fmul_s(vm_t *vm, instruction_t *ins);
+int fmul_d(vm_t *vm, instruction_t *ins);
+int fdiv_s(vm_t *vm, instruction_t *ins);
+int fdiv_d(vm_t *vm, instruction_t *ins);
+int fsqrt_s(vm_t *vm, instruction_t *ins);
+int fsqrt_d(vm_t *vm, instruction_t *ins);
+int fsgnj_s(vm_t *vm, instruction_t *ins);
+int fsgnj_d(vm_t *vm, instruction_t *ins);
+int fminmax_s(vm_t *vm, instruction_t *ins);
+int fminmax_d(vm_t *vm, instruction_t *ins);
+int fcvt_s_d(vm_t *vm, instruction_t *ins);
+int fcvt_d_s(vm_t *vm, instruction_t *ins);
+int fcmp_s(vm_t *vm, instruction_t *ins);
+int fcmp_d(vm_t *vm, instruction_t *ins);
+int fcvt_w_s(vm_t *vm, instruction_t *ins);
+int fcvt_w_d(vm_t *vm, instruction_t *ins);
+int fcvt_s_w(vm_t *vm, instruction_t *ins);
+int fcvt_d_w(vm_t *vm, instruction_t *ins);
+int fmv_x_w(vm_t *vm, instruction_t *ins);
+int fclass_d(vm_t *vm, instruction_t *ins);
+int fmv_w_x(vm_t *vm, instruction_t *ins);
+int fmadd_s(vm_t *vm, instruction_t *ins);
+int fmadd_d(vm_t *vm, instruction_t *ins);
+int fmsub_s(vm_t *vm, instruction_t *ins);
+int fmsub_d(vm_t *vm, instruction_t *ins);
+int fnmsub_s(vm_t *vm, instruction_t *ins);
+int fnmsub_d(vm_t *vm, instruction_t *ins);
+int fnmadd_s(vm_t *vm, instruction_t *ins);
+int fnmadd_d(vm_t *vm, instruction_t *ins);
+bool set_rounding(vm_t *vm, instruction_t *ins);
+uint32_t fp_flags(vm_t *vm);
+float f_read_s(vm_t *vm, int reg);
+void f_write_s(vm_t *vm, int reg, float value);
+double f_read_d(vm_t *vm, int reg);
+void f_write_d(vm_t *vm, int reg, double value);
+uint32_t fp_to_int(vm_t *vm, instruction_t *ins, double value);
+uint32_t fp_class(uint64_t sign, uint64_t exponent, uint64_t mantissa, uint64_t exp_max, uint64_t quiet);
+//vector
+int vsetvl(vm_t *vm, instruction_t *ins);
+int vload(vm_t *vm, instruction_t *ins);
+int vstore(vm_t *vm, instruction_t *ins);
+int vop_ivv(vm_t *vm, instruction_t *ins);
+int vop_ivi(vm_t *vm, instruction_t *ins);
+int vop_ivx(vm_t *vm, instruction_t *ins);
+int vop_mvv(vm_t *vm, instruction_t *ins);
+int vop_mvx(vm_t *vm, instruction_t *ins);
+int v_arith(vm_t *vm, instruction_t *ins, bool opm, uint8_t *vs1, uint64_t scalar);
+int v_reduce(vm_t *vm, instruction_t *ins);
+void v_write(vm_t *vm, bool masked, uint8_t *vd, uint32_t first, void *result, int size);
+void v_write_mask(vm_t *vm, bool masked, uint8_t *vd, uint32_t first, void *result, int size);
+uint32_t v_sew(vm_t *vm);
+//control and status registers
+uint64_t retired(vm_t *vm);
+bool csr_read(vm_t *vm, uint32_t csr, uint32_t *value);
+bool csr_write(vm_t *vm, uint32_t csr, uint32_t value);
+bool csr_check(vm_t *vm, instruction_t *ins, uint32_t csr, bool write);
+//privilege modes, traps and Sv32
+int system_ins(vm_t *vm, instruction_t *ins);
+int mret(vm_t *vm, instruction_t *ins);
+int sret(vm_t *vm, instruction_t *ins);
+int sfence_vma(vm_t *vm, instruction_t *ins);
+int exception(vm_t *vm, uint32_t cause, uint32_t tval);
+void take_trap(vm_t *vm, uint32_t cause, uint32_t tval, uint32_t epc);
+bool trap_handler(vm_t *vm, uint32_t cause);
+void check_interrupts(vm_t *vm);
+void set_priv(vm_t *vm, int priv, uint32_t old_status);
+void tlb_flush(vm_t *vm);
+uint8_t *tlb_miss(vm_t *vm, uint32_t address, uint32_t size, int access);
+uint8_t *tlb_fill(vm_t *vm, uint32_t address, int access);
+bool page_walk(vm_t *vm, uint32_t address, int access, int priv, uint64_t *physical);
+
+static inline uint8_t *mem_access(vm_t *vm, uint32_t address, uint32_t size, int access){
+    //host address of a guest access, NULL when it trapped. Aligned accesses
+    //that hit the TLB cost one compare and an add, the rest take tlb_miss
+    tlb_entry_t *entry = &vm->tlb[access][(address >> PAGE_SHIFT) % TLB_SIZE];
+    if((address & (PAGE_MASK | (size - 1))) == entry->tag){
+        return (uint8_t *)(entry->addend + address);
+    }
+    return tlb_miss(vm, address, size, access);
+}
 
 i_opcodes I_functions_bitwise[8][2] = {
     {addi, NULL},
@@ -131,20 +541,131 @@ U_instruction U_functions[2] = {lui, auipc};
 branch_operations B_functions[] = {beq, bne, NULL, NULL, blt, bge, bltu, bgeu};
 load_operations L_functions[] = {lb, lh, lw, NULL, lbu, lhu};
 s_type_ins S_functions[] = {sb, sh, sw};
+csr_operations CSR_functions[] = {system_ins, csrrw, csrrs, csrrc, NULL, csrrwi, csrrsi, csrrci};
+//width 0, 5, 6, 7 are vector loads and stores of 8, 16, 32 and 64 bit elements
+load_operations FL_functions[8] = {vload, NULL, flw, fld, NULL, vload, vload, vload};
+s_type_ins FS_functions[8] = {vstore, NULL, fsw, fsd, NULL, vstore, vstore, vstore};
+v_operations V_functions[8] = {vop_ivv, NULL, vop_mvv, vop_ivi, vop_ivx, NULL, vop_mvx, vsetvl};
+
+//indexed by funct5 and fmt (0 single, 1 double)
+fp_operations FP_functions[32][2] = {
+    [0x00] = {fadd_s, fadd_d},
+    [0x01] = {fsub_s, fsub_d},
+    [0x02] = {fmul_s, fmul_d},
+    [0x03] = {fdiv_s, fdiv_d},
+    [0x04] = {fsgnj_s, fsgnj_d},
+    [0x05] = {fminmax_s, fminmax_d},
+    [0x08] = {fcvt_s_d, fcvt_d_s},
+    [0x0B] = {fsqrt_s, fsqrt_d},
+    [0x14] = {fcmp_s, fcmp_d},
+    [0x18] = {fcvt_w_s, fcvt_w_d},
+    [0x1A] = {fcvt_s_w, fcvt_d_w},
+    [0x1C] = {fmv_x_w, fclass_d},
+    [0x1E] = {fmv_w_x, NULL},
+};
+
+//indexed by opcode bits 3:2 and fmt
+fp_operations FMA_functions[4][2] = {
+    {fmadd_s, fmadd_d}, // 0x43
+    {fmsub_s, fmsub_d}, // 0x47
+    {fnmsub_s, fnmsub_d}, // 0x4B
+    {fnmadd_s, fnmadd_d}, // 0x4F
+};
+
+batch_operations Batch_R_functions[8][2] = {
+    {batch_add, batch_sub},
+    {batch_sll, NULL},
+    {batch_slt, NULL},
+    {batch_sltu, NULL},
+    {batch_xor, NULL},
+    {batch_srl, batch_sra},
+    {batch_or, NULL},
+    {batch_and, NULL}
+};
+
+batch_operations Batch_I_functions[8][2] = {
+    {batch_addi, NULL},
+    {batch_slli, NULL},
+    {batch_slti, NULL},
+    {batch_sltiu, NULL},
+    {batch_xori, NULL},
+    {batch_srli, batch_srai},
+    {batch_ori, NULL},
+    {batch_andi, NULL}
+};
+
+batch_operations Batch_B_functions[] = {batch_beq, batch_bne, NULL, NULL, batch_blt, batch_bge, batch_bltu, batch_bgeu};
+
+host_map_t host_maps[MAX_HOST_MAPS];
+int host_map_count = 0;
+uint8_t *host_map_memory = NULL; //guest memory while output maps are live, for sync_host_files at exit
+bool dump_mem = false;
+char *gdb_address = NULL; //--gdb=<port> or --gdb=unix:<path>
 
 int main(int argc, char *argv[]){
 
     int fd;
     struct stat st;
     uint8_t *disk;
-    FILE *file;
-    
-    if(argc == 1){
-        fprintf(stderr, "Usage: %s <binary input file>\n", argv[0]);
+    FILE *file = NULL;
+    char *file_name = NULL;
+    char **inputs = NULL; //batch input files, one per lane
+    int input_count = 0;
+    bool batch = false;
+    uint32_t batch_address = 0;
+
+    if((inputs = malloc(argc * sizeof(char *))) == NULL){
+        perror("Malloc error");
+        exit(1);
+    }
+
+    for(int index = 1; index < argc; index++){
+        if(strncmp(argv[index], "--map-in=", 9) == 0){
+            if(!parse_host_map(argv[index] + 9, false)){
+                exit(1);
+            }
+        }
+        else if(strncmp(argv[index], "--map-out=", 10) == 0){
+            if(!parse_host_map(argv[index] + 10, true)){
+                exit(1);
+            }
+        }
+        else if(strncmp(argv[index], "--gdb=", 6) == 0){
+            gdb_address = argv[index] + 6;
+        }
+        else if(strcmp(argv[index], "--dump-mem") == 0){
+            dump_mem = true;
+        }
+        else if(strncmp(argv[index], "--batch=", 8) == 0){
+            char *end;
+            unsigned long address = strtoul(argv[index] + 8, &end, 0);
+            if(end == argv[index] + 8 || *end != '\0' || address >= mem_size){
+                fprintf(stderr, "Batch address %s must be a number below %#x\n", argv[index] + 8, mem_size);
+                exit(1);
+            }
+            batch = true;
+            batch_address = address;
+        }
+        else if(file_name == NULL){
+            file_name = argv[index];
+        }
+        else{ //options may come before, between or after the inputs
+            inputs[input_count++] = argv[index];
+        }
+    }
+
+    if(file_name == NULL ||
+       (batch && (input_count == 0 || host_map_count != 0 || dump_mem || gdb_address != NULL)) ||
+       (!batch && input_count != 0)){
+        fprintf(stderr, "Usage: %s [--map-in=<file>@<address>] "
+                        "[--map-out=<file>@<address>:<size>] [--dump-mem]\n"
+                        "       [--gdb=<port>|--gdb=unix:<path>] <binary input file>\n"
+                        "       %s --batch=<address> <binary input file> <lane input>...\n",
+                        argv[0], argv[0]);
         exit(1);
     }
-    else if(argc == 2){
-        file = fopen(argv[1], "rb");
+    else{
+        file = fopen(file_name, "rb");
     }
     //or hardcode the inputfile into the binary
     //else{
@@ -173,17 +694,23 @@ int main(int argc, char *argv[]){
     }
     else{
         fclose(file);
-        run(disk, st.st_size);
+        if(batch){
+            run_batch(disk, st.st_size, inputs, input_count, batch_address);
+        }
+        else{
+            run(disk, st.st_size);
+        }
     }
 
 free(disk);
+free(inputs);
 return 0;
 }
 
 void decode(instruction_t *ins){
 
     ins->opcode = (ins->machinecode & MASK_7_BIT);
-    if(ins->opcode == 0x33){ // type R
+    if(ins->opcode == 0x33 || ins->opcode == 0x57){ // type R, vector uses funct7 as funct6 and vm
         ins->rd = (ins->machinecode >> 7) & MASK_5_BIT;
         ins->rs1 = (ins->machinecode >> 15) & MASK_5_BIT;
         ins->rs2 = (ins->machinecode >> 20) & MASK_5_BIT;
@@ -200,13 +727,14 @@ void decode(instruction_t *ins){
             ins->imm |= 0xfffff000;
         }
         ins->funct7 = (ins->machinecode >> 25) & MASK_7_BIT;
-        ins->f7_index = (ins->funct7 == 0x20) ? 1: 0;
+        //only the shifts have funct7, for the rest these bits are part of imm
+        ins->f7_index = (ins->funct3 == 5 && ins->funct7 == 0x20) ? 1: 0;
     }
     else if(ins->opcode == 0x37 || ins->opcode == 0x17){ // lui or auipc
         ins->rd = (ins->machinecode >> 7) & MASK_5_BIT;
         ins->imm = (ins->machinecode >> 12);
     }
-    else if(ins->opcode == 0x23){ //store operation
+    else if(ins->opcode == 0x23 || ins->opcode == 0x27){ //store operation, integer or float
         ins->rs1 = (ins->machinecode >> 15) & MASK_5_BIT;
         ins->rs2 = (ins->machinecode >> 20) & MASK_5_BIT;
         ins->funct3 = (ins->machinecode >> 12) & MASK_3_BIT;
@@ -217,7 +745,7 @@ void decode(instruction_t *ins){
             ins->imm |= 0xfffff000;
         }
     }
-    else if(ins->opcode == 0x03){ //load operation
+    else if(ins->opcode == 0x03 || ins->opcode == 0x07){ //load operation, integer or float
         //same as I type
         ins->rd = (ins->machinecode >> 7) & MASK_5_BIT;
         ins->funct3 = (ins->machinecode >> 12) & MASK_3_BIT;
@@ -250,8 +778,107 @@ void decode(instruction_t *ins){
         // sign extend
         ins->imm = ((int32_t)(ins->imm << (32 - 20))) >> (32-20);
     }
+    else if(ins->opcode == 0x53){ //floating point, R type with fmt in funct7
+        ins->rd = (ins->machinecode >> 7) & MASK_5_BIT;
+        ins->rs1 = (ins->machinecode >> 15) & MASK_5_BIT;
+        ins->rs2 = (ins->machinecode >> 20) & MASK_5_BIT;
+        ins->funct3 = (ins->machinecode >> 12) & MASK_3_BIT; //rounding mode for most
+        ins->funct7 = (ins->machinecode >> 25) & MASK_7_BIT;
+        ins->f7_index = ins->funct7 & 0x3;
+    }
+    else if((ins->opcode & 0x73) == 0x43){ //fused multiply add, R4 type 0x43 0x47 0x4B 0x4F
+        ins->rd = (ins->machinecode >> 7) & MASK_5_BIT;
+        ins->rs1 = (ins->machinecode >> 15) & MASK_5_BIT;
+        ins->rs2 = (ins->machinecode >> 20) & MASK_5_BIT;
+        ins->rs3 = (ins->machinecode >> 27) & MASK_5_BIT;
+        ins->funct3 = (ins->machinecode >> 12) & MASK_3_BIT;
+        ins->f7_index = (ins->machinecode >> 25) & 0x3;
+    }
+    //other opcodes are left to the caller, which reports or traps them
+}
+
+static inline void execute(vm_t *vm, instruction_t *ins){
+    //instructions without an implementation raise an illegal instruction trap
+    int (*operation)(vm_t *, instruction_t *) = NULL;
+    decode(ins);
+    vm->registers[REG_ZERO] = 0;
+    if(ins->opcode == 0x33 && (ins->funct7 == 0x00 || ins->funct7 == 0x20)){ //R-type
+        operation = R_functions[ins->funct3][ins->f7_index];
+    }
+    else if(ins->opcode == 0x13){ // I-type
+        operation = I_functions_bitwise[ins->funct3][ins->f7_index];
+    }
+    else if(ins->opcode == 0x37){
+        operation = lui;
+    }
+    else if(ins->opcode == 0x17){
+        operation = auipc;
+    }
+    else if(ins->opcode == 0x23 && ins->funct3 < 3){
+        operation = S_functions[ins->funct3];
+    }
+    else if(ins->opcode == 0x03 && ins->funct3 < 6){
+        operation = L_functions[ins->funct3];
+    }
+    else if(ins->opcode == 0x63){
+        operation = B_functions[ins->funct3];
+    }
+    else if(ins->opcode == 0x6F){
+        operation = jal;
+    }
+    else if(ins->opcode == 0x67){
+        operation = jalr;
+    }
+    else if(ins->opcode == 0x07){
+        operation = FL_functions[ins->funct3];
+    }
+    else if(ins->opcode == 0x27){
+        operation = FS_functions[ins->funct3];
+    }
+    else if(ins->opcode == 0x57){
+        operation = V_functions[ins->funct3];
+    }
+    else if(ins->opcode == 0x53 && ins->f7_index < 2){
+        operation = FP_functions[ins->funct7 >> 2][ins->f7_index];
+    }
+    else if((ins->opcode & 0x73) == 0x43 && ins->f7_index < 2){
+        operation = FMA_functions[(ins->opcode >> 2) & 0x3][ins->f7_index];
+    }
+    else if(ins->opcode == 0x73){ //ecall, ebreak, trap returns or Zicsr
+        operation = CSR_functions[ins->funct3];
+    }
+
+    if(operation != NULL){
+        operation(vm, ins);
+    }
+    else{
+        DEBUG("Unknown instruction: Opcode=%#x\n", ins->opcode);
+        exception(vm, CAUSE_ILLEGAL_INSTRUCTION, ins->machinecode);
+    }
+}
+
+static inline void step(vm_t *vm, instruction_t *ins){
+    //fetch, decode and execute the instruction at PC
+    uint32_t instruction_PC = REG(PC_REG);
+    uint8_t *fetch = mem_access(vm, instruction_PC, 4, ACCESS_FETCH);
+    if(fetch != NULL){ //a fetch fault already moved PC to the trap handler
+        ins->machinecode = *(uint32_t*)fetch;
+        execute(vm, ins);
+    }
+
+    if(!vm->branch){
+        REG(PC_REG) += 4;
+    }
     else{
-        fprintf(stderr, "Decode: Unknown opcode %#x\n", ins->opcode);
+        //a block ends at every taken branch, count it as retired here
+        //instead of incrementing a counter for each instruction
+        vm->branch = false;
+        vm->instret += ((instruction_PC - vm->block_start) >> 2) + 1;
+        vm->block_start = REG(PC_REG);
+    }
+
+    if(REG(PC_REG) % 4 != 0){
+        fprintf(stderr, "Memory alignment error.");
         exit(1);
     }
 }
@@ -261,72 +888,163 @@ void run(uint8_t *disk, long signed size){
     vm_t vm;
     memset(&vm, 0x00, sizeof(vm)); // set registers to zero
     vm.disk = disk;
+    vm.memory = mmap(NULL, mem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(vm.memory == MAP_FAILED){
+        perror("Memory mmap error");
+        exit(1);
+    }
     memcpy(vm.memory, vm.disk, size);// copy data from disk to mem.
+    map_host_files(&vm, size);
     vm.branch = false;
     vm.running = true; //turn on machine
+    vm.block_start = PC;
+    clock_gettime(CLOCK_MONOTONIC, &vm.start_time);
+    vm.priv = PRIV_M;
+    tlb_flush(&vm);
+    vm.host_round = FE_TONEAREST;
+    fesetround(FE_TONEAREST);
+    feclearexcept(FE_ALL_EXCEPT);
 
     instruction_t instruction;
 
+    if(gdb_address != NULL){
+        gdb_serve(&vm, &instruction); //returns when the debugger detaches or kills
+    }
     while(vm.running){
+        step(&vm, &instruction);
+    }
 
-        instruction.machinecode = (vm.memory[PC + 0]) <<  0 |
-                                  (vm.memory[PC + 1]) <<  8 |
-                                  (vm.memory[PC + 2]) << 16 |
-                                  (vm.memory[PC + 3]) << 24;
+    unmap_host_files(&vm);
+}
 
-        decode(&instruction);
-        vm.registers[REG_ZERO] = 0;
-        if(instruction.opcode == 0x33){ //R-type
-            R_functions[instruction.funct3][instruction.f7_index](&vm, &instruction);
-        }
-        else if(instruction.opcode == 0x13){ // I-type
-            I_functions_bitwise[instruction.funct3][instruction.f7_index](&vm, &instruction);
-        }
-        else if(instruction.opcode == 0x37){
-            lui(&vm, &instruction);
-        }
-        else if(instruction.opcode == 0x17){
-            auipc(&vm, &instruction);
-        }
-        else if(instruction.opcode == 0x23){
-            S_functions[instruction.funct3](&vm, &instruction);
-        }
-        else if(instruction.opcode == 0x03){
-            L_functions[instruction.funct3](&vm, &instruction);
-        }
-        else if(instruction.opcode == 0x63){
-            B_functions[instruction.funct3](&vm, &instruction);
-        }
-        else if(instruction.opcode == 0x6F){
-            jal(&vm, &instruction);
+bool parse_host_map(char *arg, bool writable){
+    //<file>@<address> for inputs, <file>@<address>:<size> for outputs
+    if(host_map_count == MAX_HOST_MAPS){
+        fprintf(stderr, "Too many host maps, max is %d\n", MAX_HOST_MAPS);
+        return false;
+    }
+    host_map_t *map = &host_maps[host_map_count];
+    char *at = strrchr(arg, '@');
+    char *end;
+    if(at == NULL || at == arg){
+        fprintf(stderr, "Host map %s: expected <file>@<address>\n", arg);
+        return false;
+    }
+    *at = '\0';
+    map->path = arg;
+    map->writable = writable;
+    map->address = strtoul(at + 1, &end, 0);
+    map->size = 0;
+    if(writable){
+        if(*end != ':'){
+            fprintf(stderr, "Host map %s: expected <file>@<address>:<size>\n", arg);
+            return false;
         }
-        else if(instruction.opcode == 0x67){
-            jalr(&vm, &instruction);
+        map->size = strtoul(end + 1, &end, 0);
+    }
+    if(*end != '\0'){
+        fprintf(stderr, "Host map %s: bad address or size\n", arg);
+        return false;
+    }
+    host_map_count++;
+    return true;
+}
+
+void map_host_files(vm_t *vm, long signed image_size){
+    //map each host file directly over its part of the guest memory so the
+    //guest reads and writes the file with plain loads and stores
+    long page_size = sysconf(_SC_PAGESIZE);
+    struct stat st;
+
+    for(int index = 0; index < host_map_count; index++){
+        host_map_t *map = &host_maps[index];
+        int fd = open(map->path, map->writable ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+        if(fd == -1){
+            perror(map->path);
+            exit(1);
         }
-        else if(instruction.opcode == 0x73){ //ecall
-            ecall(&vm);
+        if(map->writable){
+            if(ftruncate(fd, map->size) != 0){
+                perror("Host map ftruncate error");
+                exit(1);
+            }
         }
         else{
-            fprintf(stderr, "Unknown instruction: Opcode=%#x\n", instruction.opcode);
-            exit(100);
+            if(fstat(fd, &st) != 0){
+                perror("Host map stat error");
+                exit(1);
+            }
+            map->size = st.st_size;
         }
 
-        if(!vm.branch){
-            vm.registers[PC_REG] += 4;
+        //the tail of the last page past the end of the file is mapped as well,
+        //for outputs it is zero filled and never written back to the file
+        map->span = ((uint64_t)map->size + page_size - 1) / page_size * page_size;
+        if(map->size == 0 || map->address % page_size != 0 ||
+           (uint64_t)map->address + map->span > mem_size || map->address < image_size){
+            fprintf(stderr, "Host map %s: %u bytes at %#x must be page aligned, "
+                            "non empty and inside memory after the image\n",
+                            map->path, map->size, map->address);
+            exit(1);
         }
-        else{
-            vm.branch = false;
+        for(int other = 0; other < index; other++){
+            if(map->address < host_maps[other].address + host_maps[other].span &&
+               host_maps[other].address < map->address + map->span){
+                fprintf(stderr, "Host map %s overlaps %s\n", map->path, host_maps[other].path);
+                exit(1);
+            }
         }
 
-        if(vm.registers[PC_REG] % 4 != 0){
-            fprintf(stderr, "Memory alignment error.");
+        //inputs are read only, guest stores to them raise a store access fault in tlb_fill
+        void *addr = mmap(vm->memory + map->address, map->span, map->writable ? (PROT_READ | PROT_WRITE) : PROT_READ,
+                          (map->writable ? MAP_SHARED : MAP_PRIVATE) | MAP_FIXED, fd, 0);
+        if(addr == MAP_FAILED){
+            perror("Host map mmap error");
             exit(1);
         }
+        close(fd);
+    }
+    if(host_map_count != 0){
+        host_map_memory = vm->memory;
+        atexit(sync_host_files); //the vm also exits through exit() on errors and unhandled traps
+    }
+}
+
+void sync_host_files(void){
+    if(host_map_memory == NULL){
+        return;
+    }
+    for(int index = 0; index < host_map_count; index++){
+        if(host_maps[index].writable &&
+           msync(host_map_memory + host_maps[index].address, host_maps[index].span, MS_SYNC) != 0){
+            perror("Host map msync error");
+        }
+    }
+    host_map_memory = NULL;
+}
+
+void unmap_host_files(vm_t *vm){
+    sync_host_files();
+    munmap(vm->memory, mem_size); //also removes the host maps
+}
+
+bool host_map_read_only(uint64_t physical){
+    //true inside a --map-in region
+    for(int index = 0; index < host_map_count; index++){
+        if(!host_maps[index].writable && physical >= host_maps[index].address &&
+           physical < (uint64_t)host_maps[index].address + host_maps[index].span){
+            return true;
+        }
     }
+    return false;
 }
 
 int sb(vm_t *vm, instruction_t *ins){
-    vm->memory[REG(ins->rs1) + ins->imm] = (REG(ins->rs2) & 0xFF);
+    uint8_t *host = mem_access(vm, REG(ins->rs1) + ins->imm, 1, ACCESS_STORE);
+    if(host == NULL){
+        return 0;
+    }
+    *host = (REG(ins->rs2) & 0xFF);
     DEBUG("SB x%i imm=%i %#x\n", ins->rs2, (ins->imm & 0xFF), ins->rs1);
     DEBUG_REG(vm);
     DEBUG_MEM(vm, REG(ins->rs1) + ins->imm, 4);
@@ -334,8 +1052,12 @@ int sb(vm_t *vm, instruction_t *ins){
 }
 
 int sh(vm_t *vm, instruction_t *ins){
-    vm->memory[REG(ins->rs1) + ins->imm] = (REG(ins->rs2) & 0xFF);
-    vm->memory[(REG(ins->rs1) + ins->imm) + 1] = ((REG(ins->rs2) & 0xFF00) >> 0x8);
+    uint8_t *host = mem_access(vm, REG(ins->rs1) + ins->imm, 2, ACCESS_STORE);
+    if(host == NULL){
+        return 0;
+    }
+    host[0] = (REG(ins->rs2) & 0xFF);
+    host[1] = ((REG(ins->rs2) & 0xFF00) >> 0x8);
     DEBUG("SH x%i imm=%i %#x\n", ins->rs2, (ins->imm & 0xFFFF), ins->rs1);
     DEBUG_REG(vm);
     DEBUG_MEM(vm, REG(ins->rs1) + ins->imm, 4);
@@ -343,7 +1065,11 @@ int sh(vm_t *vm, instruction_t *ins){
 }
 
 int sw(vm_t *vm, instruction_t *ins){
-    *(uint32_t*)(&vm->memory[REG(ins->rs1) + ins->imm]) = REG(ins->rs2);
+    uint8_t *host = mem_access(vm, REG(ins->rs1) + ins->imm, 4, ACCESS_STORE);
+    if(host == NULL){
+        return 0;
+    }
+    *(uint32_t*)host = REG(ins->rs2);
     DEBUG("SW x%i imm=%i %#x\n", ins->rs2, ins->imm, ins->rs1);
     DEBUG_REG(vm);
     DEBUG_MEM(vm, REG(ins->rs1) + ins->imm, 4);
@@ -450,8 +1176,15 @@ void print_mem(vm_t *vm, int address, int size){
 }
 
 int ecall(vm_t *vm){
+    //without a trap handler ecall is the simulator's exit call as before.
+    //With one it traps, except that an exit call from M-mode always exits
+    uint32_t cause = CAUSE_USER_ECALL + vm->priv;
+    bool exit_call = (REG(17) == 10 || REG(10) == 10);
     DEBUG_REG(vm);
-    if(REG(17) == 10 || REG(10) == 10){
+    if(trap_handler(vm, cause) && !(vm->priv == PRIV_M && exit_call)){
+        return exception(vm, cause, 0);
+    }
+    if(exit_call){
         vm->running = false;
 
         FILE *fp = fopen("vm_out.res", "wb");
@@ -468,12 +1201,77 @@ int ecall(vm_t *vm){
 
         fclose(fp);
 
+        if(dump_mem){
+            write_memory_dump(vm);
+        }
+
         if(debug_ins){
             puts("ecall: Register value saved in reg_out.bin");
         }
     }
     return 0;
 }
+
+uint64_t page_hash(const uint8_t *page){
+    //FNV-1a over 64 bit words instead of bytes, with a final mix
+    uint64_t hash = 0xcbf29ce484222325ull;
+    uint64_t word;
+    for(int index = 0; index < PAGE_SIZE; index += sizeof(word)){
+        memcpy(&word, page + index, sizeof(word));
+        hash = (hash ^ word) * 0x100000001b3ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+void write_memory_dump(vm_t *vm){
+    //only the pages written by the program are saved, see mem_dump_header_t
+    mem_dump_header_t header = {{'R', 'V', 'M', 'D'}, PAGE_SIZE, 0};
+    mem_dump_entry_t index[MEM_PAGES];
+
+    for(uint32_t page = 0; page < MEM_PAGES; page++){
+        if(vm->dirty[page]){
+            index[header.page_count].page = page;
+            index[header.page_count].reserved = 0;
+            index[header.page_count].hash = page_hash(vm->memory + page * PAGE_SIZE);
+            header.page_count++;
+        }
+    }
+
+    FILE *fp = fopen("vm_out.mem", "wb");
+    if(fp == NULL){
+        fprintf(stderr, "ecall: vm_out.mem open error\n");
+        exit(1);
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+              fwrite(index, sizeof(index[0]), header.page_count, fp) == header.page_count;
+    for(uint32_t entry = 0; ok && entry < header.page_count; entry++){
+        ok = fwrite(vm->memory + index[entry].page * PAGE_SIZE, PAGE_SIZE, 1, fp) == 1;
+    }
+    if(!ok){
+        fprintf(stderr, "ecall: vm_out.mem write error\n");
+        exit(1);
+    }
+    fclose(fp);
+}
+
+int ebreak(vm_t *vm){
+    if(gdb_address == NULL){ //no debugger, ebreak traps or behaves like ecall as before
+        if(trap_handler(vm, CAUSE_BREAKPOINT)){
+            return exception(vm, CAUSE_BREAKPOINT, REG(PC_REG));
+        }
+        return ecall(vm);
+    }
+    //stop on the ebreak, the PC is not advanced and it is not retired
+    vm->running = false;
+    vm->stop = STOP_BREAKPOINT;
+    vm->branch = true;
+    vm->instret--;
+    return 0;
+}
+
 int jalr(vm_t *vm, instruction_t *ins){
     uint32_t current_PC = REG(PC_REG);
     REG(ins->rd) = REG(PC_REG) + 4;
@@ -578,35 +1376,55 @@ int auipc(vm_t *vm, instruction_t *ins){
 
 
 int lb(vm_t *vm, instruction_t *ins){
-    REG(ins->rd) = (int8_t)vm->memory[REG(ins->rs1) + ins->imm];
+    uint8_t *host = mem_access(vm, REG(ins->rs1) + ins->imm, 1, ACCESS_LOAD);
+    if(host == NULL){
+        return 0;
+    }
+    REG(ins->rd) = (int8_t)*host;
     DEBUG("LB x%i imm=%i %#x\n", ins->rs2, ins->imm, ins->rs1);
     DEBUG_REG(vm);
     return 0;
 }
 
 int lh(vm_t *vm, instruction_t *ins){
-    REG(ins->rd) = *(int16_t*)(vm->memory + REG(ins->rs1) + ins->imm);
+    uint8_t *host = mem_access(vm, REG(ins->rs1) + ins->imm, 2, ACCESS_LOAD);
+    if(host == NULL){
+        return 0;
+    }
+    REG(ins->rd) = *(int16_t*)host;
     DEBUG("LH x%i imm=%i %#x\n", ins->rs2, ins->imm, ins->rs1);
     DEBUG_REG(vm);
     return 0;
 }
 
 int lw(vm_t *vm, instruction_t *ins){
-    REG(ins->rd) = *(int32_t*)(vm->memory + REG(ins->rs1) + ins->imm);
+    uint8_t *host = mem_access(vm, REG(ins->rs1) + ins->imm, 4, ACCESS_LOAD);
+    if(host == NULL){
+        return 0;
+    }
+    REG(ins->rd) = *(int32_t*)host;
     DEBUG("LW x%i imm=%i %#x\n", ins->rs2, ins->imm, ins->rs1);
     DEBUG_REG(vm);
     return 0;
 }
 
 int lbu(vm_t *vm, instruction_t *ins){
-    REG(ins->rd) = (uint8_t)vm->memory[REG(ins->rs1) + ins->imm];
+    uint8_t *host = mem_access(vm, REG(ins->rs1) + ins->imm, 1, ACCESS_LOAD);
+    if(host == NULL){
+        return 0;
+    }
+    REG(ins->rd) = *host;
     DEBUG("LBU x%i imm=%i %#x\n", ins->rs2, ins->imm, ins->rs1);
     DEBUG_REG(vm);
     return 0;
 }
 
 int lhu(vm_t *vm, instruction_t *ins){
-    REG(ins->rd) = *(uint16_t*)(vm->memory + REG(ins->rs1) + ins->imm);
+    uint8_t *host = mem_access(vm, REG(ins->rs1) + ins->imm, 2, ACCESS_LOAD);
+    if(host == NULL){
+        return 0;
+    }
+    REG(ins->rd) = *(uint16_t*)host;
     DEBUG("LHU x%i imm=%i %#x\n", ins->rs2, ins->imm, ins->rs1);
     DEBUG_REG(vm);
     return 0;
@@ -679,3 +1497,2481 @@ int bgeu(vm_t *vm, instruction_t *ins){
     DEBUG_REG(vm);
     return 0;
 }
+
+uint64_t retired(vm_t *vm){
+    //instructions in the current block are not yet added to instret
+    return vm->instret + ((REG(PC_REG) - vm->block_start) >> 2);
+}
+
+//returns false for CSRs that are not implemented
+bool csr_read(vm_t *vm, uint32_t csr, uint32_t *value){
+    struct timespec now;
+    uint64_t time_us;
+
+    switch(csr){
+        case CSR_CYCLE: // one cycle per instruction
+        case CSR_INSTRET:
+            *value = (uint32_t)retired(vm);
+            return true;
+        case CSR_CYCLEH:
+        case CSR_INSTRETH:
+            *value = (uint32_t)(retired(vm) >> 32);
+            return true;
+        case CSR_TIME:
+        case CSR_TIMEH:
+            //time counts microseconds since the machine was turned on
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            time_us = (uint64_t)(now.tv_sec - vm->start_time.tv_sec) * 1000000 +
+                      (now.tv_nsec - vm->start_time.tv_nsec) / 1000;
+            *value = (csr == CSR_TIME) ? (uint32_t)time_us : (uint32_t)(time_us >> 32);
+            return true;
+        case CSR_FFLAGS:
+            *value = fp_flags(vm);
+            return true;
+        case CSR_FRM:
+            *value = vm->frm;
+            return true;
+        case CSR_FCSR:
+            *value = (vm->frm << 5) | fp_flags(vm);
+            return true;
+        case CSR_VSTART:
+            *value = vm->vstart;
+            return true;
+        case CSR_VL:
+            *value = vm->vl;
+            return true;
+        case CSR_VTYPE:
+            *value = vm->vtype;
+            return true;
+        case CSR_VLENB:
+            *value = VLENB;
+            return true;
+        case CSR_SSTATUS:
+            *value = vm->mstatus & SSTATUS_MASK;
+            return true;
+        case CSR_SIE:
+            *value = vm->mie & vm->mideleg;
+            return true;
+        case CSR_SIP:
+            *value = vm->mip & vm->mideleg;
+            return true;
+        case CSR_STVEC:
+            *value = vm->stvec;
+            return true;
+        case CSR_SSCRATCH:
+            *value = vm->sscratch;
+            return true;
+        case CSR_SEPC:
+            *value = vm->sepc;
+            return true;
+        case CSR_SCAUSE:
+            *value = vm->scause;
+            return true;
+        case CSR_STVAL:
+            *value = vm->stval;
+            return true;
+        case CSR_SATP:
+            *value = vm->satp;
+            return true;
+        case CSR_MSTATUS:
+            *value = vm->mstatus;
+            return true;
+        case CSR_MISA:
+            *value = MISA_RV32;
+            return true;
+        case CSR_MEDELEG:
+            *value = vm->medeleg;
+            return true;
+        case CSR_MIDELEG:
+            *value = vm->mideleg;
+            return true;
+        case CSR_MIE:
+            *value = vm->mie;
+            return true;
+        case CSR_MIP:
+            *value = vm->mip;
+            return true;
+        case CSR_MTVEC:
+            *value = vm->mtvec;
+            return true;
+        case CSR_MSCRATCH:
+            *value = vm->mscratch;
+            return true;
+        case CSR_MEPC:
+            *value = vm->mepc;
+            return true;
+        case CSR_MCAUSE:
+            *value = vm->mcause;
+            return true;
+        case CSR_MTVAL:
+            *value = vm->mtval;
+            return true;
+        case CSR_SCOUNTEREN: //counters are readable from every mode
+        case CSR_MCOUNTEREN:
+        case CSR_MSTATUSH:
+        case CSR_MVENDORID:
+        case CSR_MARCHID:
+        case CSR_MIMPID:
+        case CSR_MHARTID:
+            *value = 0;
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool csr_write(vm_t *vm, uint32_t csr, uint32_t value){
+    uint32_t old_status = vm->mstatus;
+    switch(csr){
+        case CSR_FFLAGS:
+            vm->fflags = value & MASK_5_BIT;
+            feclearexcept(FE_ALL_EXCEPT);
+            break;
+        case CSR_FRM:
+            vm->frm = value & MASK_3_BIT;
+            break;
+        case CSR_FCSR:
+            vm->fflags = value & MASK_5_BIT;
+            vm->frm = (value >> 5) & MASK_3_BIT;
+            feclearexcept(FE_ALL_EXCEPT);
+            break;
+        case CSR_VSTART: //used by loads and stores, other vector instructions never trap midway
+            vm->vstart = value;
+            break;
+        case CSR_SSTATUS:
+            vm->mstatus = (vm->mstatus & ~SSTATUS_MASK) | (value & SSTATUS_MASK);
+            break;
+        case CSR_MSTATUS:
+            vm->mstatus = (vm->mstatus & ~MSTATUS_MASK) | (value & MSTATUS_MASK);
+            if((vm->mstatus & MSTATUS_MPP) == (2u << 11)){ //there is no mode 2
+                vm->mstatus &= ~MSTATUS_MPP;
+            }
+            break;
+        case CSR_SIE:
+            vm->mie = (vm->mie & ~vm->mideleg) | (value & vm->mideleg & MIP_MASK);
+            break;
+        case CSR_SIP: //only the software interrupt can be set from S-mode
+            vm->mip = (vm->mip & ~(vm->mideleg & MIP_SSIP)) | (value & vm->mideleg & MIP_SSIP);
+            break;
+        case CSR_STVEC:
+            vm->stvec = value & ~0x2u; //direct or vectored mode
+            break;
+        case CSR_SSCRATCH:
+            vm->sscratch = value;
+            break;
+        case CSR_SEPC:
+            vm->sepc = value & ~0x3u;
+            break;
+        case CSR_SCAUSE:
+            vm->scause = value;
+            break;
+        case CSR_STVAL:
+            vm->stval = value;
+            break;
+        case CSR_SATP: //the ASID is not kept, every change flushes the TLB
+            vm->satp = value & (SATP_MODE | SATP_PPN);
+            tlb_flush(vm);
+            break;
+        case CSR_MEDELEG: //every implemented exception except ecall from M-mode
+            vm->medeleg = value & 0xB3FF;
+            break;
+        case CSR_MIDELEG:
+            vm->mideleg = value & MIP_S_MASK;
+            break;
+        case CSR_MIE:
+            vm->mie = value & MIP_MASK;
+            break;
+        case CSR_MIP: //timer and external interrupts have no source, software can raise them
+            vm->mip = (vm->mip & ~MIP_S_MASK) | (value & MIP_S_MASK);
+            break;
+        case CSR_MTVEC:
+            vm->mtvec = value & ~0x2u;
+            break;
+        case CSR_MSCRATCH:
+            vm->mscratch = value;
+            break;
+        case CSR_MEPC:
+            vm->mepc = value & ~0x3u;
+            break;
+        case CSR_MCAUSE:
+            vm->mcause = value;
+            break;
+        case CSR_MTVAL:
+            vm->mtval = value;
+            break;
+        case CSR_MISA: //fixed, writes are ignored
+        case CSR_SCOUNTEREN:
+        case CSR_MCOUNTEREN:
+        case CSR_MSTATUSH:
+            break;
+        default:
+            return false;
+    }
+    if((old_status ^ vm->mstatus) & MSTATUS_TRANSLATION){
+        tlb_flush(vm);
+    }
+    //interrupts are only raised by software, so they can only become
+    //pending and enabled here or at a trap return
+    check_interrupts(vm);
+    return true;
+}
+
+bool csr_check(vm_t *vm, instruction_t *ins, uint32_t csr, bool write){
+    //csr[9:8] is the lowest privilege mode that can access the CSR and
+    //csr[11:10] == 0b11 marks a read-only CSR
+    if(vm->priv < (int)((csr >> 8) & 0x3) || (write && (csr >> 10) == 0x3) ||
+       (csr == CSR_SATP && vm->priv == PRIV_S && (vm->mstatus & MSTATUS_TVM))){
+        exception(vm, CAUSE_ILLEGAL_INSTRUCTION, ins->machinecode);
+        return false;
+    }
+    return true;
+}
+
+int csrrw(vm_t *vm, instruction_t *ins){
+    uint32_t csr = ins->imm & MASK_12_BIT;
+    uint32_t value = REG(ins->rs1);
+    if(!csr_check(vm, ins, csr, true)){
+        return 0;
+    }
+    uint32_t old = 0;
+    //csrrw with rd=x0 does not read the CSR, rd is written last so a trap
+    //leaves it untouched
+    if((ins->rd != REG_ZERO && !csr_read(vm, csr, &old)) || !csr_write(vm, csr, value)){
+        exception(vm, CAUSE_ILLEGAL_INSTRUCTION, ins->machinecode);
+        return 0;
+    }
+    if(ins->rd != REG_ZERO){
+        REG(ins->rd) = old;
+    }
+    DEBUG("CSRRW x%i %#x x%i\n", ins->rd, csr, ins->rs1);
+    DEBUG_REG(vm);
+    return 0;
+}
+
+int csrrs(vm_t *vm, instruction_t *ins){
+    uint32_t csr = ins->imm & MASK_12_BIT;
+    uint32_t value = REG(ins->rs1);
+    if(!csr_check(vm, ins, csr, ins->rs1 != REG_ZERO)){
+        return 0;
+    }
+    uint32_t old;
+    //csrrs with rs1=x0 does not write the CSR
+    if(!csr_read(vm, csr, &old) ||
+       (ins->rs1 != REG_ZERO && !csr_write(vm, csr, old | value))){
+        exception(vm, CAUSE_ILLEGAL_INSTRUCTION, ins->machinecode);
+        return 0;
+    }
+    REG(ins->rd) = old;
+    DEBUG("CSRRS x%i %#x x%i\n", ins->rd, csr, ins->rs1);
+    DEBUG_REG(vm);
+    return 0;
+}
+
+int csrrc(vm_t *vm, instruction_t *ins){
+    uint32_t csr = ins->imm & MASK_12_BIT;
+    uint32_t value = REG(ins->rs1);
+    if(!csr_check(vm, ins, csr, ins->rs1 != REG_ZERO)){
+        return 0;
+    }
+    uint32_t old;
+    if(!csr_read(vm, csr, &old) ||
+       (ins->rs1 != REG_ZERO && !csr_write(vm, csr, old & ~value))){
+        exception(vm, CAUSE_ILLEGAL_INSTRUCTION, ins->machinecode);
+        return 0;
+    }
+    REG(ins->rd) = old;
+    DEBUG("CSRRC x%i %#x x%i\n", ins->rd, csr, ins->rs1);
+    DEBUG_REG(vm);
+    return 0;
+}
+
+int csrrwi(vm_t *vm, instruction_t *ins){
+    uint32_t csr = ins->imm & MASK_12_BIT;
+    uint32_t uimm = ins->rs1; //rs1 field holds a 5 bit zero extended immediate
+    if(!csr_check(vm, ins, csr, true)){
+        return 0;
+    }
+    uint32_t old = 0;
+    //csrrwi with rd=x0 does not read the CSR, rd is written last so a trap
+    //leaves it untouched
+    if((ins->rd != REG_ZERO && !csr_read(vm, csr, &old)) || !csr_write(vm, csr, uimm)){
+        exception(vm, CAUSE_ILLEGAL_INSTRUCTION, ins->machinecode);
+        return 0;
+    }
+    if(ins->rd != REG_ZERO){
+        REG(ins->rd) = old;
+    }
+    DEBUG("CSRRWI x%i %#x imm=%#x\n", ins->rd, csr, uimm);
+    DEBUG_REG(vm);
+    return 0;
+}
+
+int csrrsi(vm_t *vm, instruction_t *ins){
+    uint32_t csr = ins->imm & MASK_12_BIT;
+    uint32_t uimm = ins->rs1;
+    if(!csr_check(vm, ins, csr, uimm != 0)){
+        return 0;
+    }
+    uint32_t old;
+    if(!csr_read(vm, csr, &old) ||
+       (uimm != 0 && !csr_write(vm, csr, old | uimm))){
+        exception(vm, CAUSE_ILLEGAL_INSTRUCTION, ins->machinecode);
+        return 0;
+    }
+    REG(ins->rd) = old;
+    DEBUG("CSRRSI x%i %#x imm=%#x\n", ins->rd, csr, uimm);
+    DEBUG_REG(vm);
+    return 0;
+}
+
+int csrrci(vm_t *vm, instruction_t *ins){
+    uint32_t csr = ins->imm & MASK_12_BIT;
+    uint32_t uimm = ins->rs1;
+    if(!csr_check(vm, ins, csr, uimm != 0)){
+        return 0;
+    }
+    uint32_t old;
+    if(!csr_read(vm, csr, &old) ||
+       (uimm != 0 && !csr_write(vm, csr, old & ~uimm))){
+        exception(vm, CAUSE_ILLEGAL_INSTRUCTION, ins->machinecode);
+        return 0;
+    }
+    REG(ins->rd) = old;
+    DEBUG("CSRRCI x%i %#x imm=%#x\n", ins->rd, csr, uimm);
+    DEBUG_REG(vm);
+    return 0;
+}
+
+int system_ins(vm_t *vm, instruction_t *ins){
+    //funct3 0 of the system opcode, told apart by the immediate
+    if(ins->funct7 == 0x09){
+        return sfence_vma(vm, ins);
+    }
+    switch(ins->imm & MASK_12_BIT){
+        case 0x000:
+            return ecall(vm);
+        case 0x001:
+            return ebreak(vm);
+        case 0x102:
+            return sret(vm, ins);
+        case 0x302:
+            return mret(vm, ins);
+        case 0x105: //wfi, nothing but software raises interrupts so there is nothing to wait for
+            if(vm->priv == PRIV_U || (vm->priv == PRIV_S && (vm->mstatus & MSTATUS_TW))){
+                return exception(vm, CAUSE_ILLEGAL_INSTRUCTION, ins->machinecode);
+            }
+            DEBUG("WFI\n");
+            return 0;
+        default:
+            return exception(vm, CAUSE_ILLEGAL_INSTRUCTION, ins->machinecode);
+    }
+}
+
+int mret(vm_t *vm, instruction_t *ins){
+    if(vm->priv != PRIV_M){
+        return exception(vm, CAUSE_ILLEGAL_INSTRUCTION, ins->machinecode);
+    }
+    int previous = (vm->mstatus & MSTATUS_MPP) >> 11;
+    uint32_t old_status = vm->mstatus;
+    vm->mstatus = (vm->mstatus & ~(MSTATUS_MIE | MSTATUS_MPP)) | MSTATUS_MPIE |
+                  ((vm->mstatus & MSTATUS_MPIE) ? MSTATUS_MIE : 0);
+    if(previous != PRIV_M){
+        vm->mstatus &= ~MSTATUS_MPRV;
+    }
+    REG(PC_REG) = vm->mepc;
+    vm->branch = true;
+    set_priv(vm, previous, old_status);
+    DEBUG("MRET to %#x priv=%d\n", REG(PC_REG), previous);
+    check_interrupts(vm);
+    return 0;
+}
+
+int sret(vm_t *vm, instruction_t *ins){
+    if(vm->priv == PRIV_U || (vm->priv == PRIV_S && (vm->mstatus & MSTATUS_TSR))){
+        return exception(vm, CAUSE_ILLEGAL_INSTRUCTION, ins->machinecode);
+    }
+    int previous = (vm->mstatus & MSTATUS_SPP) ? PRIV_S : PRIV_U;
+    uint32_t old_status = vm->mstatus;
+    vm->mstatus = (vm->mstatus & ~(MSTATUS_SIE | MSTATUS_SPP | MSTATUS_MPRV)) | MSTATUS_SPIE |
+                  ((vm->mstatus & MSTATUS_SPIE) ? MSTATUS_SIE : 0);
+    REG(PC_REG) = vm->sepc;
+    vm->branch = true;
+    set_priv(vm, previous, old_status);
+    DEBUG("SRET to %#x priv=%d\n", REG(PC_REG), previous);
+    check_interrupts(vm);
+    return 0;
+}
+
+int sfence_vma(vm_t *vm, instruction_t *ins){
+    if(vm->priv == PRIV_U || (vm->priv == PRIV_S && (vm->mstatus & MSTATUS_TVM))){
+        return exception(vm, CAUSE_ILLEGAL_INSTRUCTION, ins->machinecode);
+    }
+    if(ins->rs1 == REG_ZERO){
+        tlb_flush(vm);
+    }
+    else{ //one page, it can only be in one entry of each table
+        uint32_t address = REG(ins->rs1);
+        for(int access = ACCESS_FETCH; access <= ACCESS_STORE; access++){
+            tlb_entry_t *entry = &vm->tlb[access][(address >> PAGE_SHIFT) % TLB_SIZE];
+            if(entry->tag == (address & PAGE_MASK)){
+                entry->tag = ~0u;
+            }
+        }
+    }
+    DEBUG("SFENCE.VMA x%i\n", ins->rs1);
+    return 0;
+}
+
+bool trap_handler(vm_t *vm, uint32_t cause){
+    //a trap vector of 0 means no handler is installed, which is how the
+    //programs written before privilege modes run
+    uint32_t delegated = (cause & CAUSE_INTERRUPT) ? vm->mideleg : vm->medeleg;
+    if(vm->priv <= PRIV_S && ((delegated >> (cause & MASK_5_BIT)) & 1)){
+        return vm->stvec != 0;
+    }
+    return vm->mtvec != 0;
+}
+
+int exception(vm_t *vm, uint32_t cause, uint32_t tval){
+    //the faulting instruction is not retired, it is counted when the block
+    //ends at the trap so take one off here
+    vm->instret--;
+    take_trap(vm, cause, tval, REG(PC_REG));
+    return 0;
+}
+
+void take_trap(vm_t *vm, uint32_t cause, uint32_t tval, uint32_t epc){
+    bool interrupt = (cause & CAUSE_INTERRUPT) != 0;
+    uint32_t code = cause & MASK_5_BIT;
+    uint32_t delegated = interrupt ? vm->mideleg : vm->medeleg;
+    uint32_t old_status = vm->mstatus;
+    uint32_t vector;
+
+    if(!trap_handler(vm, cause)){
+        fprintf(stderr, "Unhandled trap cause=%#x tval=%#x at PC=%#x\n", cause, tval, epc);
+        exit(1);
+    }
+    DEBUG("TRAP cause=%#x tval=%#x epc=%#x\n", cause, tval, epc);
+    if(vm->priv <= PRIV_S && ((delegated >> code) & 1)){
+        vector = vm->stvec;
+        vm->sepc = epc;
+        vm->scause = cause;
+        vm->stval = tval;
+        vm->mstatus = (vm->mstatus & ~(MSTATUS_SIE | MSTATUS_SPIE | MSTATUS_SPP)) |
+                      ((vm->mstatus & MSTATUS_SIE) ? MSTATUS_SPIE : 0) |
+                      ((vm->priv == PRIV_S) ? MSTATUS_SPP : 0);
+        set_priv(vm, PRIV_S, old_status);
+    }
+    else{
+        vector = vm->mtvec;
+        vm->mepc = epc;
+        vm->mcause = cause;
+        vm->mtval = tval;
+        vm->mstatus = (vm->mstatus & ~(MSTATUS_MIE | MSTATUS_MPIE | MSTATUS_MPP)) |
+                      ((vm->mstatus & MSTATUS_MIE) ? MSTATUS_MPIE : 0) | ((uint32_t)vm->priv << 11);
+        set_priv(vm, PRIV_M, old_status);
+    }
+    //vectored mode sends interrupts to vector + 4 * cause
+    REG(PC_REG) = (vector & ~0x3u) + (((vector & 0x1) && interrupt) ? 4 * code : 0);
+    vm->branch = true;
+}
+
+void check_interrupts(vm_t *vm){
+    //M-mode interrupts are taken in lower modes or with MIE set, delegated
+    //ones below M-mode, in U-mode or in S-mode with SIE set
+    static const uint32_t priority[] = {11, 3, 7, 9, 1, 5}; //MEI MSI MTI SEI SSI STI
+    uint32_t pending = vm->mip & vm->mie;
+    uint32_t enabled = 0;
+    if(pending == 0){
+        return;
+    }
+    if(vm->priv < PRIV_M || (vm->mstatus & MSTATUS_MIE)){
+        enabled = pending & ~vm->mideleg;
+    }
+    if(enabled == 0 && (vm->priv == PRIV_U || (vm->priv == PRIV_S && (vm->mstatus & MSTATUS_SIE)))){
+        enabled = pending & vm->mideleg;
+    }
+    for(int index = 0; enabled != 0 && index < 6; index++){
+        if((enabled >> priority[index]) & 1){
+            //the current instruction has completed, the handler returns after it
+            take_trap(vm, CAUSE_INTERRUPT | priority[index], 0, vm->branch ? REG(PC_REG) : REG(PC_REG) + 4);
+            return;
+        }
+    }
+}
+
+void set_priv(vm_t *vm, int priv, uint32_t old_status){
+    //translations are cached with the permissions of one mode and mstatus,
+    //an M-mode trap or mret can change MPP and MPRV without leaving M-mode
+    if(vm->priv != priv || ((old_status ^ vm->mstatus) & MSTATUS_TRANSLATION)){
+        vm->priv = priv;
+        tlb_flush(vm);
+    }
+}
+
+void tlb_flush(vm_t *vm){
+    //all ones has low bits set, so it never equals a page aligned tag
+    memset(vm->tlb, 0xFF, sizeof(vm->tlb));
+}
+
+uint8_t *tlb_miss(vm_t *vm, uint32_t address, uint32_t size, int access){
+    //misaligned accesses are done by the host when both pages are next to
+    //each other in guest memory, otherwise they raise a misaligned exception
+    static const uint32_t misaligned_cause[] = {0, 4, 6};
+    uint8_t *host = tlb_fill(vm, address, access);
+    if(host != NULL && (address & ~PAGE_MASK) + size > PAGE_SIZE){
+        uint32_t next_page = (address & PAGE_MASK) + PAGE_SIZE;
+        uint8_t *next_host = tlb_fill(vm, next_page, access);
+        if(next_host == NULL){
+            return NULL;
+        }
+        if(next_host != host + (next_page - address)){
+            exception(vm, misaligned_cause[access], address);
+            return NULL;
+        }
+    }
+    return host;
+}
+
+uint8_t *tlb_fill(vm_t *vm, uint32_t address, int access){
+    //translate one page and cache it, NULL when the access trapped
+    static const uint32_t access_fault_cause[] = {1, 5, 7};
+    int priv = vm->priv;
+    uint64_t physical = address;
+    tlb_entry_t *entry;
+    uint8_t *page;
+
+    if(access != ACCESS_FETCH && priv == PRIV_M && (vm->mstatus & MSTATUS_MPRV)){
+        priv = (vm->mstatus & MSTATUS_MPP) >> 11; //loads and stores as the previous mode
+    }
+    if(priv != PRIV_M && (vm->satp & SATP_MODE) && !page_walk(vm, address, access, priv, &physical)){
+        return NULL;
+    }
+    if(physical >= mem_size || (access == ACCESS_STORE && host_map_read_only(physical))){
+        exception(vm, access_fault_cause[access], address);
+        return NULL;
+    }
+    if(access == ACCESS_STORE){ //stores fill the store TLB before writing, so this finds every dirty page
+        vm->dirty[physical >> PAGE_SHIFT] = 1;
+    }
+    page = vm->memory + (physical & PAGE_MASK);
+    if(gdb_address != NULL && gdb_code_page(vm, physical, access, &page) && access == ACCESS_STORE){
+        return vm->memory + physical; //not cached, so every store to the page marks its fetch copy stale
+    }
+    entry = &vm->tlb[access][(address >> PAGE_SHIFT) % TLB_SIZE];
+    entry->tag = address & PAGE_MASK;
+    entry->addend = (uintptr_t)page - (address & PAGE_MASK);
+    return page + (physical & ~PAGE_MASK);
+}
+
+bool page_walk(vm_t *vm, uint32_t address, int access, int priv, uint64_t *physical){
+    //two level Sv32 walk. The A and D bits are set by the walk instead of
+    //faulting, so a store to a clean page walks once more to set D
+    static const uint32_t page_fault_cause[] = {12, 13, 15};
+    static const uint32_t access_fault_cause[] = {1, 5, 7};
+    uint64_t table = (uint64_t)(vm->satp & SATP_PPN) << PAGE_SHIFT;
+    uint64_t pte_address = 0;
+    uint32_t pte = 0;
+    int level;
+
+    for(level = 1; level >= 0; level--){
+        pte_address = table + ((address >> (PAGE_SHIFT + 10 * level)) & 0x3FF) * 4;
+        if(pte_address >= mem_size){
+            exception(vm, access_fault_cause[access], address);
+            return false;
+        }
+        pte = *(uint32_t*)(vm->memory + pte_address);
+        if(!(pte & PTE_V) || ((pte & PTE_W) && !(pte & PTE_R))){
+            level = -1; //invalid
+            break;
+        }
+        if(pte & (PTE_R | PTE_X)){ //leaf
+            break;
+        }
+        table = (uint64_t)(pte >> 10) << PAGE_SHIFT;
+    }
+
+    bool allowed = (level >= 0);
+    if(allowed && priv == PRIV_U){
+        allowed = (pte & PTE_U) != 0;
+    }
+    else if(allowed && (pte & PTE_U)){ //S-mode reaches user pages only for data with SUM set
+        allowed = (access != ACCESS_FETCH) && (vm->mstatus & MSTATUS_SUM);
+    }
+    if(access == ACCESS_FETCH){
+        allowed = allowed && (pte & PTE_X);
+    }
+    else if(access == ACCESS_LOAD){
+        allowed = allowed && ((pte & PTE_R) || ((pte & PTE_X) && (vm->mstatus & MSTATUS_MXR)));
+    }
+    else{
+        allowed = allowed && (pte & PTE_W);
+    }
+    if(allowed && level == 1 && ((pte >> 10) & 0x3FF) != 0){ //misaligned megapage
+        allowed = false;
+    }
+    if(!allowed){
+        exception(vm, page_fault_cause[access], address);
+        return false;
+    }
+
+    uint32_t updated = pte | PTE_A | ((access == ACCESS_STORE) ? PTE_D : 0);
+    if(updated != pte && host_map_read_only(pte_address)){ //page table inside a --map-in region
+        exception(vm, access_fault_cause[access], address);
+        return false;
+    }
+    if(updated != pte){
+        *(uint32_t*)(vm->memory + pte_address) = updated;
+        vm->dirty[pte_address >> PAGE_SHIFT] = 1;
+    }
+    if(level == 1){ //4 MiB megapage
+        *physical = ((uint64_t)(pte >> 20) << 22) | (address & 0x3FFFFF);
+    }
+    else{
+        *physical = ((uint64_t)(pte >> 10) << PAGE_SHIFT) | (address & ~PAGE_MASK);
+    }
+    return true;
+}
+
+uint32_t fp_flags(vm_t *vm){
+    //the host FPU accrues the flags of the arithmetic itself, they are only
+    //collected here when the guest reads them
+    int host = fetestexcept(FE_ALL_EXCEPT);
+    vm->fflags |= ((host & FE_INEXACT) ? FFLAG_NX : 0) |
+                  ((host & FE_UNDERFLOW) ? FFLAG_UF : 0) |
+                  ((host & FE_OVERFLOW) ? FFLAG_OF : 0) |
+                  ((host & FE_DIVBYZERO) ? FFLAG_DZ : 0) |
+                  ((host & FE_INVALID) ? FFLAG_NV : 0);
+    return vm->fflags;
+}
+
+bool set_rounding(vm_t *vm, instruction_t *ins){
+    //RNE, RTZ, RDN, RUP, RMM. The host has no round to nearest, ties to max
+    //magnitude, RMM uses ties to even except for conversions to integer.
+    //A reserved rounding mode raises an illegal instruction exception
+    static const int host_modes[5] = {FE_TONEAREST, FE_TOWARDZERO, FE_DOWNWARD, FE_UPWARD, FE_TONEAREST};
+    uint32_t rm = (ins->funct3 == 7) ? vm->frm : ins->funct3;
+    if(rm > 4){
+        exception(vm, CAUSE_ILLEGAL_INSTRUCTION, ins->machinecode);
+        return false;
+    }
+    if(host_modes[rm] != vm->host_round){ //changing the host mode is slow, only do it when needed
+        fesetround(host_modes[rm]);
+        vm->host_round = host_modes[rm];
+    }
+    return true;
+}
+
+float f_read_s(vm_t *vm, int reg){
+    uint32_t bits = (uint32_t)vm->fregisters[reg];
+    float value;
+    if((vm->fregisters[reg] & NAN_BOX) != NAN_BOX){ //not a valid NaN boxed single
+        bits = CANONICAL_NAN_S;
+    }
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+void f_write_s(vm_t *vm, int reg, float value){
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    vm->fregisters[reg] = NAN_BOX | bits;
+}
+
+double f_read_d(vm_t *vm, int reg){
+    double value;
+    memcpy(&value, &vm->fregisters[reg], sizeof(value));
+    return value;
+}
+
+void f_write_d(vm_t *vm, int reg, double value){
+    memcpy(&vm->fregisters[reg], &value, sizeof(value));
+}
+
+//arithmetic results that are NaN must be the canonical NaN
+# define CANONICAL_S(x) (isnan(x) ? (float)NAN : (x))
+# define CANONICAL_D(x) (isnan(x) ? (double)NAN : (x))
+# define IS_SNAN_S(x) (isnan(x) && !(f_bits_s(x) & 0x00400000u))
+# define IS_SNAN_D(x) (isnan(x) && !(f_bits_d(x) & 0x0008000000000000ull))
+
+static inline uint32_t f_bits_s(float value){
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static inline uint64_t f_bits_d(double value){
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+int flw(vm_t *vm, instruction_t *ins){
+    uint8_t *host = mem_access(vm, REG(ins->rs1) + ins->imm, 4, ACCESS_LOAD);
+    if(host == NULL){
+        return 0;
+    }
+    vm->fregisters[ins->rd] = NAN_BOX | *(uint32_t*)host;
+    DEBUG("FLW f%i imm=%i x%i\n", ins->rd, ins->imm, ins->rs1);
+    return 0;
+}
+
+int fld(vm_t *vm, instruction_t *ins){
+    uint8_t *host = mem_access(vm, REG(ins->rs1) + ins->imm, 8, ACCESS_LOAD);
+    if(host == NULL){
+        return 0;
+    }
+    vm->fregisters[ins->rd] = *(uint64_t*)host;
+    DEBUG("FLD f%i imm=%i x%i\n", ins->rd, ins->imm, ins->rs1);
+    return 0;
+}
+
+int fsw(vm_t *vm, instruction_t *ins){
+    uint8_t *host = mem_access(vm, REG(ins->rs1) + ins->imm, 4, ACCESS_STORE);
+    if(host == NULL){
+        return 0;
+    }
+    *(uint32_t*)host = (uint32_t)vm->fregisters[ins->rs2];
+    DEBUG("FSW f%i imm=%i x%i\n", ins->rs2, ins->imm, ins->rs1);
+    DEBUG_MEM(vm, REG(ins->rs1) + ins->imm, 4);
+    return 0;
+}
+
+int fsd(vm_t *vm, instruction_t *ins){
+    uint8_t *host = mem_access(vm, REG(ins->rs1) + ins->imm, 8, ACCESS_STORE);
+    if(host == NULL){
+        return 0;
+    }
+    *(uint64_t*)host = vm->fregisters[ins->rs2];
+    DEBUG("FSD f%i imm=%i x%i\n", ins->rs2, ins->imm, ins->rs1);
+    DEBUG_MEM(vm, REG(ins->rs1) + ins->imm, 8);
+    return 0;
+}
+
+//single and double versions of the arithmetic instructions, run directly on
+//the host FPU which also raises the exception flags
+# define FP_ARITHMETIC(name, NAME, op) \
+int name##_s(vm_t *vm, instruction_t *ins){ \
+    if(!set_rounding(vm, ins)){ \
+        return 0; \
+    } \
+    float result = f_read_s(vm, ins->rs1) op f_read_s(vm, ins->rs2); \
+    f_write_s(vm, ins->rd, CANONICAL_S(result)); \
+    DEBUG(NAME ".S f%i f%i f%i\n", ins->rd, ins->rs1, ins->rs2); \
+    return 0; \
+} \
+int name##_d(vm_t *vm, instruction_t *ins){ \
+    if(!set_rounding(vm, ins)){ \
+        return 0; \
+    } \
+    double result = f_read_d(vm, ins->rs1) op f_read_d(vm, ins->rs2); \
+    f_write_d(vm, ins->rd, CANONICAL_D(result)); \
+    DEBUG(NAME ".D f%i f%i f%i\n", ins->rd, ins->rs1, ins->rs2); \
+    return 0; \
+}
+
+# define FP_FUSED(name, NAME, sign_product, sign_addend) \
+int name##_s(vm_t *vm, instruction_t *ins){ \
+    if(!set_rounding(vm, ins)){ \
+        return 0; \
+    } \
+    float result = fmaf(sign_product f_read_s(vm, ins->rs1), f_read_s(vm, ins->rs2), \
+                        sign_addend f_read_s(vm, ins->rs3)); \
+    f_write_s(vm, ins->rd, CANONICAL_S(result)); \
+    DEBUG(NAME ".S f%i f%i f%i f%i\n", ins->rd, ins->rs1, ins->rs2, ins->rs3); \
+    return 0; \
+} \
+int name##_d(vm_t *vm, instruction_t *ins){ \
+    if(!set_rounding(vm, ins)){ \
+        return 0; \
+    } \
+    double result = fma(sign_product f_read_d(vm, ins->rs1), f_read_d(vm, ins->rs2), \
+                        sign_addend f_read_d(vm, ins->rs3)); \
+    f_write_d(vm, ins->rd, CANONICAL_D(result)); \
+    DEBUG(NAME ".D f%i f%i f%i f%i\n", ins->rd, ins->rs1, ins->rs2, ins->rs3); \
+    return 0; \
+}
+
+FP_ARITHMETIC(fadd, "FADD", +)
+FP_ARITHMETIC(fsub, "FSUB", -)
+FP_ARITHMETIC(fmul, "FMUL", *)
+FP_ARITHMETIC(fdiv, "FDIV", /)
+
+FP_FUSED(fmadd, "FMADD", +, +)
+FP_FUSED(fmsub, "FMSUB", +, -)
+FP_FUSED(fnmsub, "FNMSUB", -, +)
+FP_FUSED(fnmadd, "FNMADD", -, -)
+
+int fsqrt_s(vm_t *vm, instruction_t *ins){
+    if(!set_rounding(vm, ins)){
+        return 0;
+    }
+    float result = sqrtf(f_read_s(vm, ins->rs1));
+    f_write_s(vm, ins->rd, CANONICAL_S(result));
+    DEBUG("FSQRT.S f%i f%i\n", ins->rd, ins->rs1);
+    return 0;
+}
+
+int fsqrt_d(vm_t *vm, instruction_t *ins){
+    if(!set_rounding(vm, ins)){
+        return 0;
+    }
+    double result = sqrt(f_read_d(vm, ins->rs1));
+    f_write_d(vm, ins->rd, CANONICAL_D(result));
+    DEBUG("FSQRT.D f%i f%i\n", ins->rd, ins->rs1);
+    return 0;
+}
+
+int fsgnj_s(vm_t *vm, instruction_t *ins){
+    //funct3 0 fsgnj, 1 fsgnjn, 2 fsgnjx
+    uint32_t a = f_bits_s(f_read_s(vm, ins->rs1));
+    uint32_t b = f_bits_s(f_read_s(vm, ins->rs2));
+    uint32_t sign = (ins->funct3 == 0) ? b : (ins->funct3 == 1) ? ~b : (a ^ b);
+    vm->fregisters[ins->rd] = NAN_BOX | (a & 0x7fffffffu) | (sign & 0x80000000u);
+    DEBUG("FSGNJ.S f%i f%i f%i funct3=%i\n", ins->rd, ins->rs1, ins->rs2, ins->funct3);
+    return 0;
+}
+
+int fsgnj_d(vm_t *vm, instruction_t *ins){
+    uint64_t a = vm->fregisters[ins->rs1];
+    uint64_t b = vm->fregisters[ins->rs2];
+    uint64_t sign = (ins->funct3 == 0) ? b : (ins->funct3 == 1) ? ~b : (a ^ b);
+    vm->fregisters[ins->rd] = (a & 0x7fffffffffffffffull) | (sign & 0x8000000000000000ull);
+    DEBUG("FSGNJ.D f%i f%i f%i funct3=%i\n", ins->rd, ins->rs1, ins->rs2, ins->funct3);
+    return 0;
+}
+
+int fminmax_s(vm_t *vm, instruction_t *ins){
+    //funct3 0 fmin, 1 fmax. A single NaN operand is ignored and -0 < +0
+    float a = f_read_s(vm, ins->rs1);
+    float b = f_read_s(vm, ins->rs2);
+    float result;
+    if(IS_SNAN_S(a) || IS_SNAN_S(b)){
+        vm->fflags |= FFLAG_NV;
+    }
+    if(isnan(a) || isnan(b)){
+        result = isnan(a) ? CANONICAL_S(b) : a;
+    }
+    else if(a == b){
+        result = ((signbit(a) != 0) == (ins->funct3 == 0)) ? a : b;
+    }
+    else{
+        result = ((a < b) == (ins->funct3 == 0)) ? a : b;
+    }
+    f_write_s(vm, ins->rd, result);
+    DEBUG("FMINMAX.S f%i f%i f%i funct3=%i\n", ins->rd, ins->rs1, ins->rs2, ins->funct3);
+    return 0;
+}
+
+int fminmax_d(vm_t *vm, instruction_t *ins){
+    double a = f_read_d(vm, ins->rs1);
+    double b = f_read_d(vm, ins->rs2);
+    double result;
+    if(IS_SNAN_D(a) || IS_SNAN_D(b)){
+        vm->fflags |= FFLAG_NV;
+    }
+    if(isnan(a) || isnan(b)){
+        result = isnan(a) ? CANONICAL_D(b) : a;
+    }
+    else if(a == b){
+        result = ((signbit(a) != 0) == (ins->funct3 == 0)) ? a : b;
+    }
+    else{
+        result = ((a < b) == (ins->funct3 == 0)) ? a : b;
+    }
+    f_write_d(vm, ins->rd, result);
+    DEBUG("FMINMAX.D f%i f%i f%i funct3=%i\n", ins->rd, ins->rs1, ins->rs2, ins->funct3);
+    return 0;
+}
+
+int fcvt_s_d(vm_t *vm, instruction_t *ins){
+    if(!set_rounding(vm, ins)){
+        return 0;
+    }
+    float result = (float)f_read_d(vm, ins->rs1);
+    f_write_s(vm, ins->rd, CANONICAL_S(result));
+    DEBUG("FCVT.S.D f%i f%i\n", ins->rd, ins->rs1);
+    return 0;
+}
+
+int fcvt_d_s(vm_t *vm, instruction_t *ins){
+    double result = (double)f_read_s(vm, ins->rs1); //exact
+    f_write_d(vm, ins->rd, CANONICAL_D(result));
+    DEBUG("FCVT.D.S f%i f%i\n", ins->rd, ins->rs1);
+    return 0;
+}
+
+int fcmp_s(vm_t *vm, instruction_t *ins){
+    //funct3 2 feq, 1 flt, 0 fle. feq is quiet, flt and fle signal on any NaN
+    float a = f_read_s(vm, ins->rs1);
+    float b = f_read_s(vm, ins->rs2);
+    if(isnan(a) || isnan(b)){
+        if(ins->funct3 != 2 || IS_SNAN_S(a) || IS_SNAN_S(b)){
+            vm->fflags |= FFLAG_NV;
+        }
+        REG(ins->rd) = 0;
+    }
+    else{
+        REG(ins->rd) = (ins->funct3 == 2) ? (a == b) : (ins->funct3 == 1) ? (a < b) : (a <= b);
+    }
+    DEBUG("FCMP.S x%i f%i f%i funct3=%i\n", ins->rd, ins->rs1, ins->rs2, ins->funct3);
+    DEBUG_REG(vm);
+    return 0;
+}
+
+int fcmp_d(vm_t *vm, instruction_t *ins){
+    double a = f_read_d(vm, ins->rs1);
+    double b = f_read_d(vm, ins->rs2);
+    if(isnan(a) || isnan(b)){
+        if(ins->funct3 != 2 || IS_SNAN_D(a) || IS_SNAN_D(b)){
+            vm->fflags |= FFLAG_NV;
+        }
+        REG(ins->rd) = 0;
+    }
+    else{
+        REG(ins->rd) = (ins->funct3 == 2) ? (a == b) : (ins->funct3 == 1) ? (a < b) : (a <= b);
+    }
+    DEBUG("FCMP.D x%i f%i f%i funct3=%i\n", ins->rd, ins->rs1, ins->rs2, ins->funct3);
+    DEBUG_REG(vm);
+    return 0;
+}
+
+uint32_t fp_to_int(vm_t *vm, instruction_t *ins, double value){
+    //rs2 0 signed, 1 unsigned. Out of range and NaN saturate and raise NV only.
+    //The caller has set the rounding mode
+    bool is_unsigned = (ins->rs2 == 1);
+    uint32_t rm = (ins->funct3 == 7) ? vm->frm : ins->funct3;
+    double rounded;
+
+    rounded = (rm == 4) ? round(value) : nearbyint(value); //neither raises inexact
+    if(isnan(value)){
+        vm->fflags |= FFLAG_NV;
+        return is_unsigned ? UINT32_MAX : INT32_MAX;
+    }
+    if(is_unsigned ? (rounded < 0.0 || rounded > 4294967295.0) :
+                     (rounded < -2147483648.0 || rounded > 2147483647.0)){
+        vm->fflags |= FFLAG_NV;
+        return (rounded < 0.0) ? (is_unsigned ? 0 : (uint32_t)INT32_MIN) :
+                                 (is_unsigned ? UINT32_MAX : INT32_MAX);
+    }
+    if(rounded != value){
+        vm->fflags |= FFLAG_NX;
+    }
+    return is_unsigned ? (uint32_t)rounded : (uint32_t)(int32_t)rounded;
+}
+
+int fcvt_w_s(vm_t *vm, instruction_t *ins){
+    if(!set_rounding(vm, ins)){
+        return 0;
+    }
+    REG(ins->rd) = fp_to_int(vm, ins, f_read_s(vm, ins->rs1));
+    DEBUG("FCVT.W.S x%i f%i unsigned=%i\n", ins->rd, ins->rs1, ins->rs2);
+    DEBUG_REG(vm);
+    return 0;
+}
+
+int fcvt_w_d(vm_t *vm, instruction_t *ins){
+    if(!set_rounding(vm, ins)){
+        return 0;
+    }
+    REG(ins->rd) = fp_to_int(vm, ins, f_read_d(vm, ins->rs1));
+    DEBUG("FCVT.W.D x%i f%i unsigned=%i\n", ins->rd, ins->rs1, ins->rs2);
+    DEBUG_REG(vm);
+    return 0;
+}
+
+int fcvt_s_w(vm_t *vm, instruction_t *ins){
+    if(!set_rounding(vm, ins)){
+        return 0;
+    }
+    if(ins->rs2 == 1){
+        f_write_s(vm, ins->rd, (float)REG(ins->rs1));
+    }
+    else{
+        f_write_s(vm, ins->rd, (float)(int32_t)REG(ins->rs1));
+    }
+    DEBUG("FCVT.S.W f%i x%i unsigned=%i\n", ins->rd, ins->rs1, ins->rs2);
+    return 0;
+}
+
+int fcvt_d_w(vm_t *vm, instruction_t *ins){
+    //exact, every 32 bit integer fits in a double
+    if(ins->rs2 == 1){
+        f_write_d(vm, ins->rd, (double)REG(ins->rs1));
+    }
+    else{
+        f_write_d(vm, ins->rd, (double)(int32_t)REG(ins->rs1));
+    }
+    DEBUG("FCVT.D.W f%i x%i unsigned=%i\n", ins->rd, ins->rs1, ins->rs2);
+    return 0;
+}
+
+uint32_t fp_class(uint64_t sign, uint64_t exponent, uint64_t mantissa, uint64_t exp_max, uint64_t quiet){
+    //bit 0 -inf, 1 -normal, 2 -subnormal, 3 -0, 4 +0, 5 +subnormal, 6 +normal, 7 +inf, 8 sNaN, 9 qNaN
+    if(exponent == exp_max){
+        if(mantissa == 0){
+            return sign ? 1u << 0 : 1u << 7;
+        }
+        return (mantissa & quiet) ? 1u << 9 : 1u << 8;
+    }
+    if(exponent == 0){
+        if(mantissa == 0){
+            return sign ? 1u << 3 : 1u << 4;
+        }
+        return sign ? 1u << 2 : 1u << 5;
+    }
+    return sign ? 1u << 1 : 1u << 6;
+}
+
+int fmv_x_w(vm_t *vm, instruction_t *ins){
+    //funct3 0 fmv.x.w, 1 fclass.s
+    if(ins->funct3 == 0){
+        REG(ins->rd) = (uint32_t)vm->fregisters[ins->rs1];
+        DEBUG("FMV.X.W x%i f%i\n", ins->rd, ins->rs1);
+    }
+    else{
+        uint32_t bits = f_bits_s(f_read_s(vm, ins->rs1));
+        REG(ins->rd) = fp_class(bits >> 31, (bits >> 23) & 0xff, bits & 0x7fffff, 0xff, 0x400000);
+        DEBUG("FCLASS.S x%i f%i\n", ins->rd, ins->rs1);
+    }
+    DEBUG_REG(vm);
+    return 0;
+}
+
+int fclass_d(vm_t *vm, instruction_t *ins){
+    uint64_t bits = vm->fregisters[ins->rs1];
+    REG(ins->rd) = fp_class(bits >> 63, (bits >> 52) & 0x7ff, bits & 0xfffffffffffffull,
+                            0x7ff, 0x8000000000000ull);
+    DEBUG("FCLASS.D x%i f%i\n", ins->rd, ins->rs1);
+    DEBUG_REG(vm);
+    return 0;
+}
+
+int fmv_w_x(vm_t *vm, instruction_t *ins){
+    vm->fregisters[ins->rd] = NAN_BOX | REG(ins->rs1);
+    DEBUG("FMV.W.X f%i x%i\n", ins->rd, ins->rs1);
+    return 0;
+}
+
+# define VREG(r) (vm->vregisters + (r) * VLENB)
+# define V_MASK_BIT(index) ((vm->vregisters[(index) >> 3] >> ((index) & 7)) & 1) // v0.t
+# define V_IS_MASKED(ins) (((ins)->machinecode >> 25 & 1) == 0)
+//unsupported encodings, an illegal vtype and register groups past v31 raise
+//an illegal instruction exception
+# define V_ILLEGAL() return exception(vm, CAUSE_ILLEGAL_INSTRUCTION, ins->machinecode)
+# define V_CHECK_GROUP(reg, size) do{ if((reg) * VLENB + vm->vl * (size) > sizeof(vm->vregisters)){ \
+    V_ILLEGAL(); }}while(0)
+
+uint32_t v_sew(vm_t *vm){
+    //0 when vtype is illegal
+    if(vm->vtype & VTYPE_VILL){
+        return 0;
+    }
+    return 8 << ((vm->vtype >> 3) & 0x7);
+}
+
+int vsetvl(vm_t *vm, instruction_t *ins){
+    //vsetvli bit 31 = 0, vsetivli bits 31:30 = 11 and AVL in rs1, vsetvl bit 31 = 1 and vtype in rs2
+    uint32_t vtype, avl;
+    if((ins->machinecode >> 31) == 0){
+        vtype = (ins->machinecode >> 20) & 0x7FF;
+        avl = REG(ins->rs1);
+    }
+    else if((ins->machinecode >> 30) == 0x3){
+        vtype = (ins->machinecode >> 20) & 0x3FF;
+        avl = ins->rs1;
+    }
+    else{
+        vtype = REG(ins->rs2);
+        avl = REG(ins->rs1);
+    }
+
+    uint32_t vsew = (vtype >> 3) & 0x7;
+    uint32_t vlmul = vtype & 0x7;
+    uint32_t vlmax = (vlmul < 4) ? (VLEN >> (vsew + 3)) << vlmul : (VLEN >> (vsew + 3)) >> (8 - vlmul);
+    if(vsew > 3 || vlmul == 4 || vlmax == 0 || (vtype >> 8) != 0){ //ELEN is 64, no reserved bits
+        vm->vtype = VTYPE_VILL;
+        vm->vl = 0;
+    }
+    else{
+        if(ins->rs1 == REG_ZERO && (ins->machinecode >> 30) != 0x3){
+            //rs1 = x0 keeps vl when rd = x0, otherwise asks for VLMAX
+            avl = (ins->rd == REG_ZERO) ? vm->vl : UINT32_MAX;
+        }
+        vm->vtype = vtype;
+        vm->vl = (avl < vlmax) ? avl : vlmax;
+    }
+    vm->vstart = 0;
+    REG(ins->rd) = vm->vl;
+    DEBUG("VSETVL x%i vtype=%#x vl=%u\n", ins->rd, vm->vtype, vm->vl);
+    DEBUG_REG(vm);
+    return 0;
+}
+
+int vload(vm_t *vm, instruction_t *ins){
+    //unit stride (mop 0) and strided (mop 2), EEW comes from the width field
+    uint32_t size = (ins->funct3 == 0) ? 1 : 1 << (ins->funct3 - 4);
+    uint32_t mop = (ins->machinecode >> 26) & 0x3;
+    uint32_t nf = ins->machinecode >> 29;
+    uint32_t lumop = (ins->machinecode >> 20) & MASK_5_BIT;
+    uint32_t address = REG(ins->rs1);
+    uint8_t *vd = VREG(ins->rd);
+    bool masked = V_IS_MASKED(ins);
+
+    if(v_sew(vm) == 0 || nf != 0 || (mop != 0 && mop != 2) || (mop == 0 && lumop != 0)){
+        V_ILLEGAL();
+    }
+    V_CHECK_GROUP(ins->rd, size);
+    if(mop == 0 && !masked && vm->vstart == 0 && vm->vl != 0 && (address & ~PAGE_MASK) + vm->vl * size <= PAGE_SIZE){
+        //unit stride within one page is a single translation
+        uint8_t *host = mem_access(vm, address, 1, ACCESS_LOAD);
+        if(host == NULL){
+            return 0;
+        }
+        memcpy(vd, host, vm->vl * size);
+    }
+    else{
+        int32_t stride = (mop == 2) ? (int32_t)REG(lumop) : (int32_t)size; //lumop holds rs2
+        //a fault leaves the element in vstart, the retry after the trap goes on from there
+        for(uint32_t index = vm->vstart; index < vm->vl; index++){
+            if(!masked || V_MASK_BIT(index)){
+                uint8_t *host = mem_access(vm, address + index * stride, size, ACCESS_LOAD);
+                if(host == NULL){
+                    vm->vstart = index;
+                    return 0;
+                }
+                memcpy(vd + index * size, host, size);
+            }
+        }
+    }
+    vm->vstart = 0;
+    DEBUG("VLOAD v%i x%i eew=%u mop=%u vl=%u\n", ins->rd, ins->rs1, size * 8, mop, vm->vl);
+    return 0;
+}
+
+int vstore(vm_t *vm, instruction_t *ins){
+    uint32_t size = (ins->funct3 == 0) ? 1 : 1 << (ins->funct3 - 4);
+    uint32_t mop = (ins->machinecode >> 26) & 0x3;
+    uint32_t nf = ins->machinecode >> 29;
+    uint32_t sumop = (ins->machinecode >> 20) & MASK_5_BIT;
+    uint32_t vs3 = (ins->machinecode >> 7) & MASK_5_BIT;
+    uint32_t address = REG(ins->rs1);
+    uint8_t *vs = VREG(vs3);
+    bool masked = V_IS_MASKED(ins);
+
+    if(v_sew(vm) == 0 || nf != 0 || (mop != 0 && mop != 2) || (mop == 0 && sumop != 0)){
+        V_ILLEGAL();
+    }
+    V_CHECK_GROUP(vs3, size);
+    if(mop == 0 && !masked && vm->vstart == 0 && vm->vl != 0 && (address & ~PAGE_MASK) + vm->vl * size <= PAGE_SIZE){
+        uint8_t *host = mem_access(vm, address, 1, ACCESS_STORE);
+        if(host == NULL){
+            return 0;
+        }
+        memcpy(host, vs, vm->vl * size);
+    }
+    else{
+        int32_t stride = (mop == 2) ? (int32_t)REG(sumop) : (int32_t)size;
+        for(uint32_t index = vm->vstart; index < vm->vl; index++){
+            if(!masked || V_MASK_BIT(index)){
+                uint8_t *host = mem_access(vm, address + index * stride, size, ACCESS_STORE);
+                if(host == NULL){
+                    vm->vstart = index;
+                    return 0;
+                }
+                memcpy(host, vs + index * size, size);
+            }
+        }
+    }
+    vm->vstart = 0;
+    DEBUG("VSTORE v%i x%i eew=%u mop=%u vl=%u\n", vs3, ins->rs1, size * 8, mop, vm->vl);
+    DEBUG_MEM(vm, address, 4);
+    return 0;
+}
+
+void v_write(vm_t *vm, bool masked, uint8_t *vd, uint32_t first, void *result, int size){
+    //whole registers are stored at once, only the tail and masked
+    //registers are written element by element
+    uint32_t count = VLENB / size;
+    if(!masked && first + count <= vm->vl){
+        memcpy(vd + first * size, result, VLENB);
+        return;
+    }
+    for(uint32_t index = 0; index < count && first + index < vm->vl; index++){
+        if(!masked || V_MASK_BIT(first + index)){
+            memcpy(vd + (first + index) * size, (uint8_t *)result + index * size, size);
+        }
+    }
+}
+
+void v_write_mask(vm_t *vm, bool masked, uint8_t *vd, uint32_t first, void *result, int size){
+    //compare results are all ones or zero per element, packed to one bit each
+    uint32_t count = VLENB / size;
+    for(uint32_t index = 0; index < count && first + index < vm->vl; index++){
+        if(!masked || V_MASK_BIT(first + index)){
+            uint32_t bit = first + index;
+            vd[bit >> 3] = (vd[bit >> 3] & ~(1 << (bit & 7))) |
+                           ((((uint8_t *)result)[index * size] & 1) << (bit & 7));
+        }
+    }
+}
+
+//runs expr on one host vector per VLEN bits of the register group, a and d
+//are vs2 and vd, b is vs1 or the scalar operand. U, S and T are the
+//unsigned vector, signed vector and element types for the current SEW
+# define V_ELEMENTWISE(expr, write) \
+    for(uint32_t first = 0; first < vm->vl; first += VLENB / sizeof(T)){ \
+        U a, b, d = {0}, result; \
+        memcpy(&a, vs2 + first * sizeof(T), VLENB); \
+        if(out == vd){ /* compares write a mask and never read vd */ \
+            memcpy(&d, vd + first * sizeof(T), VLENB); \
+        } \
+        if(vs1 != NULL){ \
+            memcpy(&b, vs1 + first * sizeof(T), VLENB); \
+        } \
+        else{ \
+            b = (U){0} + (T)scalar; \
+        } \
+        (void)d; \
+        result = (expr); \
+        write(vm, masked, out, first, &result, sizeof(T)); \
+    }
+
+//v0.t of the elements in one host vector as all ones or zero lanes
+# define V_MASK_VECTOR(first) ({ \
+        U m; \
+        for(uint32_t index = 0; index < VLENB / sizeof(T); index++){ \
+            m[index] = ((first) + index < vm->vl && V_MASK_BIT((first) + index)) ? (T)~0 : 0; \
+        } \
+        m; \
+    })
+# define V_MIN(x, y, cast) (((x) & (U)((cast)(x) < (cast)(y))) | ((y) & ~(U)((cast)(x) < (cast)(y))))
+# define V_MAX(x, y, cast) (((x) & (U)((cast)(x) > (cast)(y))) | ((y) & ~(U)((cast)(x) > (cast)(y))))
+
+# define V_ARITH_OPS() \
+    switch(funct6){ \
+        case 0x00: V_ELEMENTWISE(a + b, v_write); break; /* vadd */ \
+        case 0x02: V_ELEMENTWISE(a - b, v_write); break; /* vsub */ \
+        case 0x03: V_ELEMENTWISE(b - a, v_write); break; /* vrsub */ \
+        case 0x04: V_ELEMENTWISE(V_MIN(a, b, U), v_write); break; /* vminu */ \
+        case 0x05: V_ELEMENTWISE(V_MIN(a, b, S), v_write); break; /* vmin */ \
+        case 0x06: V_ELEMENTWISE(V_MAX(a, b, U), v_write); break; /* vmaxu */ \
+        case 0x07: V_ELEMENTWISE(V_MAX(a, b, S), v_write); break; /* vmax */ \
+        case 0x09: V_ELEMENTWISE(a & b, v_write); break; /* vand */ \
+        case 0x0A: V_ELEMENTWISE(a | b, v_write); break; /* vor */ \
+        case 0x0B: V_ELEMENTWISE(a ^ b, v_write); break; /* vxor */ \
+        case 0x17: /* vmerge, or vmv.v when unmasked */ \
+            if(masked){ /* one pass, vd may overlap vs1 or vs2 */ \
+                masked = false; \
+                V_ELEMENTWISE(({ U m = V_MASK_VECTOR(first); (b & m) | (a & ~m); }), v_write); \
+                masked = true; \
+            } \
+            else{ \
+                V_ELEMENTWISE(b, v_write); \
+            } \
+            break; \
+        case 0x18: V_ELEMENTWISE((U)(a == b), v_write_mask); break; /* vmseq */ \
+        case 0x19: V_ELEMENTWISE((U)(a != b), v_write_mask); break; /* vmsne */ \
+        case 0x1A: V_ELEMENTWISE((U)(a < b), v_write_mask); break; /* vmsltu */ \
+        case 0x1B: V_ELEMENTWISE((U)((S)a < (S)b), v_write_mask); break; /* vmslt */ \
+        case 0x1C: V_ELEMENTWISE((U)(a <= b), v_write_mask); break; /* vmsleu */ \
+        case 0x1D: V_ELEMENTWISE((U)((S)a <= (S)b), v_write_mask); break; /* vmsle */ \
+        case 0x1E: V_ELEMENTWISE((U)(a > b), v_write_mask); break; /* vmsgtu */ \
+        case 0x1F: V_ELEMENTWISE((U)((S)a > (S)b), v_write_mask); break; /* vmsgt */ \
+        case 0x25: V_ELEMENTWISE(a << (b & (sizeof(T) * 8 - 1)), v_write); break; /* vsll */ \
+        case 0x28: V_ELEMENTWISE(a >> (b & (sizeof(T) * 8 - 1)), v_write); break; /* vsrl */ \
+        case 0x29: V_ELEMENTWISE((U)((S)a >> (S)(b & (sizeof(T) * 8 - 1))), v_write); break; /* vsra */ \
+        case 0x40 | 0x25: V_ELEMENTWISE(a * b, v_write); break; /* vmul */ \
+        case 0x40 | 0x2D: V_ELEMENTWISE(d + a * b, v_write); break; /* vmacc */ \
+        default: /* vslide, vrgather, widening and the rest */ \
+            V_ILLEGAL(); \
+    }
+
+int v_arith(vm_t *vm, instruction_t *ins, bool opm, uint8_t *vs1, uint64_t scalar){
+    //opm selects the OPMVV/OPMVX funct6 space, vs1 is NULL for scalar operands
+    uint32_t funct6 = (ins->funct7 >> 1) | (opm ? 0x40 : 0);
+    uint32_t sew = v_sew(vm);
+    bool masked = V_IS_MASKED(ins);
+    uint8_t *vs2 = VREG(ins->rs2);
+    uint8_t *vd = VREG(ins->rd);
+    uint8_t mask_out[VLENB];
+    uint8_t *out = vd;
+
+    if(sew == 0){
+        V_ILLEGAL();
+    }
+    V_CHECK_GROUP(ins->rs2, sew / 8);
+    if(vs1 != NULL){
+        V_CHECK_GROUP(ins->rs1, sew / 8);
+    }
+    if(funct6 >= 0x18 && funct6 <= 0x1F){ //compares write one mask register as a copy, vd may overlap vs2
+        memcpy(mask_out, vd, VLENB);
+        out = mask_out;
+    }
+    else{
+        V_CHECK_GROUP(ins->rd, sew / 8);
+    }
+    if(sew == 8){
+        typedef vreg_u8 U; typedef vreg_s8 S; typedef uint8_t T;
+        V_ARITH_OPS();
+    }
+    else if(sew == 16){
+        typedef vreg_u16 U; typedef vreg_s16 S; typedef uint16_t T;
+        V_ARITH_OPS();
+    }
+    else if(sew == 32){
+        typedef vreg_u32 U; typedef vreg_s32 S; typedef uint32_t T;
+        V_ARITH_OPS();
+    }
+    else{
+        typedef vreg_u64 U; typedef vreg_s64 S; typedef uint64_t T;
+        V_ARITH_OPS();
+    }
+    if(out == mask_out){
+        memcpy(vd, mask_out, VLENB);
+    }
+    vm->vstart = 0;
+    return 0;
+}
+
+//reduces the active elements of vs2 into one host vector, then its lanes
+//and vs1[0] into vd[0]. vexpr and sexpr combine x and y as vectors and scalars
+# define V_REDUCE(identity, vexpr, sexpr) \
+    { \
+        T acc = (T)(identity); \
+        U vacc = (U){0} + acc; \
+        for(uint32_t first = 0; first < vm->vl; first += VLENB / sizeof(T)){ \
+            U x = vacc, y; \
+            memcpy(&y, vs2 + first * sizeof(T), VLENB); \
+            if(masked || first + VLENB / sizeof(T) > vm->vl){ \
+                for(uint32_t index = 0; index < VLENB / sizeof(T); index++){ \
+                    if(first + index >= vm->vl || (masked && !V_MASK_BIT(first + index))){ \
+                        y[index] = acc; \
+                    } \
+                } \
+            } \
+            vacc = (vexpr); \
+        } \
+        for(uint32_t index = 0; index < VLENB / sizeof(T); index++){ \
+            T x = acc, y = vacc[index]; \
+            acc = (sexpr); \
+        } \
+        T x = acc, y = *(T *)vs1; \
+        acc = (sexpr); \
+        memcpy(vd, &acc, sizeof(T)); \
+    }
+
+# define V_REDUCE_OPS() \
+    switch(funct6){ \
+        case 0x00: V_REDUCE(0, x + y, x + y); break; /* vredsum */ \
+        case 0x01: V_REDUCE(~0, x & y, x & y); break; /* vredand */ \
+        case 0x02: V_REDUCE(0, x | y, x | y); break; /* vredor */ \
+        case 0x03: V_REDUCE(0, x ^ y, x ^ y); break; /* vredxor */ \
+        case 0x04: V_REDUCE(~0, V_MIN(x, y, U), (x < y) ? x : y); break; /* vredminu */ \
+        case 0x05: V_REDUCE((T)~0 >> 1, V_MIN(x, y, S), ((SCALAR_S)x < (SCALAR_S)y) ? x : y); break; /* vredmin */ \
+        case 0x06: V_REDUCE(0, V_MAX(x, y, U), (x > y) ? x : y); break; /* vredmaxu */ \
+        case 0x07: V_REDUCE(~((T)~0 >> 1), V_MAX(x, y, S), ((SCALAR_S)x > (SCALAR_S)y) ? x : y); break; /* vredmax */ \
+    }
+
+int v_reduce(vm_t *vm, instruction_t *ins){
+    uint32_t funct6 = ins->funct7 >> 1;
+    uint32_t sew = v_sew(vm);
+    bool masked = V_IS_MASKED(ins);
+    uint8_t *vs2 = VREG(ins->rs2);
+    uint8_t *vs1 = VREG(ins->rs1);
+    uint8_t *vd = VREG(ins->rd);
+
+    if(sew == 0){
+        V_ILLEGAL();
+    }
+    V_CHECK_GROUP(ins->rs2, sew / 8);
+    if(vm->vl == 0){ //no elements, vd is not written
+        return 0;
+    }
+    if(sew == 8){
+        typedef vreg_u8 U; typedef vreg_s8 S; typedef uint8_t T; typedef int8_t SCALAR_S;
+        V_REDUCE_OPS();
+    }
+    else if(sew == 16){
+        typedef vreg_u16 U; typedef vreg_s16 S; typedef uint16_t T; typedef int16_t SCALAR_S;
+        V_REDUCE_OPS();
+    }
+    else if(sew == 32){
+        typedef vreg_u32 U; typedef vreg_s32 S; typedef uint32_t T; typedef int32_t SCALAR_S;
+        V_REDUCE_OPS();
+    }
+    else{
+        typedef vreg_u64 U; typedef vreg_s64 S; typedef uint64_t T; typedef int64_t SCALAR_S;
+        V_REDUCE_OPS();
+    }
+    vm->vstart = 0;
+    return 0;
+}
+
+int vop_ivv(vm_t *vm, instruction_t *ins){
+    v_arith(vm, ins, false, VREG(ins->rs1), 0);
+    DEBUG("OPIVV funct6=%#x v%i v%i v%i\n", ins->funct7 >> 1, ins->rd, ins->rs2, ins->rs1);
+    return 0;
+}
+
+int vop_ivi(vm_t *vm, instruction_t *ins){
+    //rs1 holds a sign extended 5 bit immediate, the shifts vsll, vsrl and vsra take it unsigned
+    uint32_t funct6 = ins->funct7 >> 1;
+    bool shift = (funct6 == 0x25 || funct6 == 0x28 || funct6 == 0x29);
+    int64_t simm5 = shift ? (int64_t)ins->rs1 : (int32_t)(ins->rs1 << 27) >> 27;
+    v_arith(vm, ins, false, NULL, (uint64_t)simm5);
+    DEBUG("OPIVI funct6=%#x v%i v%i imm=%i\n", ins->funct7 >> 1, ins->rd, ins->rs2, (int)simm5);
+    return 0;
+}
+
+int vop_ivx(vm_t *vm, instruction_t *ins){
+    v_arith(vm, ins, false, NULL, (uint64_t)(int64_t)(int32_t)REG(ins->rs1));
+    DEBUG("OPIVX funct6=%#x v%i v%i x%i\n", ins->funct7 >> 1, ins->rd, ins->rs2, ins->rs1);
+    return 0;
+}
+
+int vop_mvv(vm_t *vm, instruction_t *ins){
+    uint32_t funct6 = ins->funct7 >> 1;
+    if(funct6 <= 0x07){
+        v_reduce(vm, ins);
+    }
+    else if(funct6 == 0x10 && ins->rs1 == 0){ //vmv.x.s, sign extends element 0
+        uint32_t sew = v_sew(vm);
+        uint8_t *vs2 = VREG(ins->rs2);
+        if(sew == 0){
+            V_ILLEGAL();
+        }
+        REG(ins->rd) = (sew == 8) ? (uint32_t)*(int8_t *)vs2 :
+                       (sew == 16) ? (uint32_t)*(int16_t *)vs2 : *(uint32_t *)vs2;
+        DEBUG_REG(vm);
+    }
+    else{
+        v_arith(vm, ins, true, VREG(ins->rs1), 0);
+    }
+    DEBUG("OPMVV funct6=%#x v%i v%i v%i\n", funct6, ins->rd, ins->rs2, ins->rs1);
+    return 0;
+}
+
+int vop_mvx(vm_t *vm, instruction_t *ins){
+    uint32_t funct6 = ins->funct7 >> 1;
+    uint64_t scalar = (uint64_t)(int64_t)(int32_t)REG(ins->rs1);
+    if(funct6 == 0x10 && ins->rs2 == 0){ //vmv.s.x
+        if(v_sew(vm) == 0){
+            V_ILLEGAL();
+        }
+        if(vm->vl > 0){
+            memcpy(VREG(ins->rd), &scalar, v_sew(vm) / 8);
+        }
+    }
+    else{
+        v_arith(vm, ins, true, NULL, scalar);
+    }
+    DEBUG("OPMVX funct6=%#x v%i v%i x%i\n", funct6, ins->rd, ins->rs2, ins->rs1);
+    return 0;
+}
+
+//gdb stub state, one debugger connection per run
+int gdb_fd = -1;
+gdb_breakpoint_t gdb_breakpoints[GDB_MAX_BREAKPOINTS];
+int gdb_breakpoint_count = 0;
+gdb_code_page_t gdb_code_pages[GDB_MAX_BREAKPOINTS];
+int gdb_code_page_count = 0;
+gdb_breakpoint_t *gdb_stepping = NULL; //left out of the fetch copy while it is stepped over
+volatile sig_atomic_t gdb_running = 0; //set while the machine runs for gdb
+volatile sig_atomic_t gdb_interrupt = 0; //Ctrl-C seen by the SIGIO handler
+gdb_watchpoint_t gdb_watchpoints[GDB_MAX_WATCHPOINTS];
+int gdb_watchpoint_count = 0;
+load_operations L_unwatched[6];
+s_type_ins S_unwatched[3];
+load_operations FL_unwatched[8];
+s_type_ins FS_unwatched[8];
+bool gdb_tables_swapped = false;
+
+const char gdb_target_xml[] =
+    "<?xml version=\"1.0\"?><!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+    "<target version=\"1.0\"><architecture>riscv:rv32</architecture>"
+    "<feature name=\"org.gnu.gdb.riscv.cpu\">"
+    "<reg name=\"zero\" bitsize=\"32\" type=\"int\" regnum=\"0\"/>"
+    "<reg name=\"ra\" bitsize=\"32\" type=\"code_ptr\"/><reg name=\"sp\" bitsize=\"32\" type=\"data_ptr\"/>"
+    "<reg name=\"gp\" bitsize=\"32\" type=\"data_ptr\"/><reg name=\"tp\" bitsize=\"32\" type=\"data_ptr\"/>"
+    "<reg name=\"t0\" bitsize=\"32\" type=\"int\"/><reg name=\"t1\" bitsize=\"32\" type=\"int\"/>"
+    "<reg name=\"t2\" bitsize=\"32\" type=\"int\"/><reg name=\"fp\" bitsize=\"32\" type=\"data_ptr\"/>"
+    "<reg name=\"s1\" bitsize=\"32\" type=\"int\"/><reg name=\"a0\" bitsize=\"32\" type=\"int\"/>"
+    "<reg name=\"a1\" bitsize=\"32\" type=\"int\"/><reg name=\"a2\" bitsize=\"32\" type=\"int\"/>"
+    "<reg name=\"a3\" bitsize=\"32\" type=\"int\"/><reg name=\"a4\" bitsize=\"32\" type=\"int\"/>"
+    "<reg name=\"a5\" bitsize=\"32\" type=\"int\"/><reg name=\"a6\" bitsize=\"32\" type=\"int\"/>"
+    "<reg name=\"a7\" bitsize=\"32\" type=\"int\"/><reg name=\"s2\" bitsize=\"32\" type=\"int\"/>"
+    "<reg name=\"s3\" bitsize=\"32\" type=\"int\"/><reg name=\"s4\" bitsize=\"32\" type=\"int\"/>"
+    "<reg name=\"s5\" bitsize=\"32\" type=\"int\"/><reg name=\"s6\" bitsize=\"32\" type=\"int\"/>"
+    "<reg name=\"s7\" bitsize=\"32\" type=\"int\"/><reg name=\"s8\" bitsize=\"32\" type=\"int\"/>"
+    "<reg name=\"s9\" bitsize=\"32\" type=\"int\"/><reg name=\"s10\" bitsize=\"32\" type=\"int\"/>"
+    "<reg name=\"s11\" bitsize=\"32\" type=\"int\"/><reg name=\"t3\" bitsize=\"32\" type=\"int\"/>"
+    "<reg name=\"t4\" bitsize=\"32\" type=\"int\"/><reg name=\"t5\" bitsize=\"32\" type=\"int\"/>"
+    "<reg name=\"t6\" bitsize=\"32\" type=\"int\"/><reg name=\"pc\" bitsize=\"32\" type=\"code_ptr\"/>"
+    "</feature></target>";
+
+static void gdb_hex_u32(char *out, uint32_t value){
+    //registers are sent as little endian bytes
+    for(int byte = 0; byte < 4; byte++){
+        sprintf(out + byte * 2, "%02x", (value >> (byte * 8)) & 0xFF);
+    }
+}
+
+static uint32_t gdb_parse_u32(const char *in){
+    uint32_t value = 0;
+    for(int byte = 0; byte < 4; byte++){
+        unsigned int part = 0;
+        sscanf(in + byte * 2, "%2x", &part);
+        value |= part << (byte * 8);
+    }
+    return value;
+}
+
+int gdb_open(char *address){
+    //--gdb=<port> listens on localhost, --gdb=unix:<path> on a unix socket
+    int listen_fd, fd;
+    if(strncmp(address, "unix:", 5) == 0){
+        struct sockaddr_un addr;
+        memset(&addr, 0x00, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", address + 5);
+        unlink(addr.sun_path);
+        listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0){
+            perror("gdb socket error");
+            exit(1);
+        }
+    }
+    else{
+        struct sockaddr_in addr;
+        int reuse = 1;
+        memset(&addr, 0x00, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(atoi(address));
+        listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if(listen_fd == -1){
+            perror("gdb socket error");
+            exit(1);
+        }
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if(bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0){
+            perror("gdb socket error");
+            exit(1);
+        }
+    }
+    if(listen(listen_fd, 1) != 0){
+        perror("gdb listen error");
+        exit(1);
+    }
+    fprintf(stderr, "Waiting for gdb on %s\n", address);
+    fd = accept(listen_fd, NULL, NULL);
+    if(fd == -1){
+        perror("gdb accept error");
+        exit(1);
+    }
+    close(listen_fd);
+    return fd;
+}
+
+void gdb_sigio(int signal){
+    //Ctrl-C from gdb arrives as a single 0x03 byte while the machine runs,
+    //gdb_resume polls the flag instead of the socket
+    char byte;
+    (void)signal;
+    if(gdb_running && recv(gdb_fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == 1 && byte == 0x03){
+        recv(gdb_fd, &byte, 1, MSG_DONTWAIT);
+        gdb_interrupt = 1;
+    }
+}
+
+char *gdb_read_packet(void){
+    //returns the data of the next $data#xx packet, NULL when gdb disconnected
+    static char packet[GDB_PACKET_SIZE];
+    char byte;
+    int length;
+
+    while(true){
+        do{
+            if(recv(gdb_fd, &byte, 1, 0) != 1){
+                return NULL;
+            }
+        }while(byte != '$'); //acks and interrupts while stopped are skipped
+
+        length = 0;
+        while(recv(gdb_fd, &byte, 1, 0) == 1 && byte != '#'){
+            if(length < GDB_PACKET_SIZE - 1){
+                packet[length++] = byte;
+            }
+        }
+        packet[length] = '\0';
+
+        char checksum[3] = {0}; //two hex digits, terminated for sscanf
+        if(recv(gdb_fd, checksum, 2, MSG_WAITALL) != 2){
+            return NULL;
+        }
+        uint8_t sum = 0;
+        for(int index = 0; index < length; index++){
+            sum += (uint8_t)packet[index];
+        }
+        unsigned int expected = 0;
+        sscanf(checksum, "%2x", &expected);
+        if(sum == expected){
+            send(gdb_fd, "+", 1, 0);
+            return packet;
+        }
+        send(gdb_fd, "-", 1, 0); //ask for a resend
+    }
+}
+
+void gdb_send_packet(const char *data){
+    static char packet[GDB_PACKET_SIZE + 8];
+    uint8_t sum = 0;
+    for(const char *c = data; *c != '\0'; c++){
+        sum += (uint8_t)*c;
+    }
+    int length = snprintf(packet, sizeof(packet), "$%s#%02x", data, sum);
+    if(send(gdb_fd, packet, length, 0) != length){
+        perror("gdb send error");
+    }
+}
+
+void gdb_stop_reply(vm_t *vm, char *reply){
+    if(vm->stop == STOP_NONE){ //the program exited with ecall
+        sprintf(reply, "W00");
+    }
+    else if(vm->stop == STOP_WATCH){
+        static const char *kind[] = {"watch", "rwatch", "awatch"}; //Z2, Z3 and Z4
+        sprintf(reply, "T05%s:%x;", kind[vm->watch_type - 2], vm->watch_address);
+    }
+    else if(vm->stop == STOP_INTERRUPT){
+        sprintf(reply, "S02");
+    }
+    else{
+        sprintf(reply, "S05");
+    }
+}
+
+void gdb_set_pc(vm_t *vm, uint32_t pc){
+    //the instructions of the current block are retired, a new block starts at pc
+    vm->instret = retired(vm);
+    vm->block_start = pc;
+    vm->branch = false;
+    REG(PC_REG) = pc;
+}
+
+static bool gdb_translate(vm_t *vm, uint32_t address, uint32_t *physical){
+    //gdb addresses are virtual like the PC. They are translated with the
+    //current mode and satp, without permission checks or A and D updates
+    uint64_t table = (uint64_t)(vm->satp & SATP_PPN) << PAGE_SHIFT;
+    *physical = address;
+    if(vm->priv == PRIV_M || !(vm->satp & SATP_MODE)){
+        return address < mem_size;
+    }
+    for(int level = 1; level >= 0; level--){
+        uint64_t pte_address = table + ((address >> (PAGE_SHIFT + 10 * level)) & 0x3FF) * 4;
+        if(pte_address >= mem_size){
+            return false;
+        }
+        uint32_t pte = *(uint32_t*)(vm->memory + pte_address);
+        if(!(pte & PTE_V)){
+            return false;
+        }
+        if(pte & (PTE_R | PTE_X)){ //leaf, a megapage at level 1
+            uint64_t result = (level == 1) ? ((uint64_t)(pte >> 20) << 22) | (address & 0x3FFFFF) :
+                                             ((uint64_t)(pte >> 10) << PAGE_SHIFT) | (address & ~PAGE_MASK);
+            *physical = result;
+            return result < mem_size;
+        }
+        table = (uint64_t)(pte >> 10) << PAGE_SHIFT;
+    }
+    return false;
+}
+
+static void gdb_code_changed(vm_t *vm){
+    //the fetch copies are made again from guest memory on the next fetch
+    for(int index = 0; index < gdb_code_page_count; index++){
+        gdb_code_pages[index].stale = true;
+    }
+    memset(vm->tlb[ACCESS_FETCH], 0xFF, sizeof(vm->tlb[ACCESS_FETCH]));
+}
+
+static void gdb_breakpoints_changed(vm_t *vm){
+    //one fetch copy for every page with breakpoints
+    gdb_code_page_count = 0;
+    for(int index = 0; index < gdb_breakpoint_count; index++){
+        uint32_t page = gdb_breakpoints[index].physical >> PAGE_SHIFT;
+        int copy = 0;
+        while(copy < gdb_code_page_count && gdb_code_pages[copy].page != page){
+            copy++;
+        }
+        if(copy == gdb_code_page_count){
+            gdb_code_pages[gdb_code_page_count++].page = page;
+        }
+    }
+    gdb_code_changed(vm);
+}
+
+bool gdb_code_page(vm_t *vm, uint32_t physical, int access, uint8_t **page){
+    //called by tlb_fill while gdb is attached. Fetches from a page with
+    //breakpoints get the patched copy, loads see guest memory as it is and
+    //stores mark the copy stale
+    if(access == ACCESS_LOAD){
+        return false;
+    }
+    for(int index = 0; index < gdb_code_page_count; index++){
+        gdb_code_page_t *copy = &gdb_code_pages[index];
+        if(copy->page != (physical >> PAGE_SHIFT)){
+            continue;
+        }
+        if(access == ACCESS_STORE){
+            copy->stale = true;
+            memset(vm->tlb[ACCESS_FETCH], 0xFF, sizeof(vm->tlb[ACCESS_FETCH]));
+            return true;
+        }
+        if(copy->stale){
+            uint32_t patch = EBREAK;
+            memcpy(copy->code, vm->memory + copy->page * PAGE_SIZE, PAGE_SIZE);
+            for(int bp = 0; bp < gdb_breakpoint_count; bp++){
+                if((gdb_breakpoints[bp].physical >> PAGE_SHIFT) == copy->page && &gdb_breakpoints[bp] != gdb_stepping){
+                    memcpy(copy->code + (gdb_breakpoints[bp].physical & ~PAGE_MASK), &patch, 4);
+                }
+            }
+            copy->stale = false;
+        }
+        *page = copy->code;
+        return true;
+    }
+    return false;
+}
+
+static gdb_breakpoint_t *gdb_find_breakpoint(uint32_t address){
+    for(int index = 0; index < gdb_breakpoint_count; index++){
+        if(gdb_breakpoints[index].address == address){
+            return &gdb_breakpoints[index];
+        }
+    }
+    return NULL;
+}
+
+void gdb_resume(vm_t *vm, instruction_t *ins, bool single_step){
+    //a breakpoint on the PC is stepped over with its original instruction,
+    //then the machine runs the normal dispatch loop until something stops it
+    gdb_breakpoint_t *breakpoint = gdb_find_breakpoint(REG(PC_REG));
+    vm->stop = STOP_NONE; //stays so if the program exits
+    vm->running = true;
+    gdb_running = 1;
+    if(breakpoint != NULL || single_step){
+        if(breakpoint != NULL){
+            gdb_stepping = breakpoint;
+            gdb_code_changed(vm);
+        }
+        step(vm, ins);
+        if(breakpoint != NULL){
+            gdb_stepping = NULL;
+            gdb_code_changed(vm);
+        }
+        if(single_step && vm->running){
+            vm->running = false;
+            vm->stop = STOP_STEP;
+        }
+    }
+    while(vm->running && !gdb_interrupt){
+        step(vm, ins);
+    }
+    gdb_running = 0;
+    if(gdb_interrupt){
+        gdb_interrupt = 0;
+        if(vm->running){
+            vm->running = false;
+            vm->stop = STOP_INTERRUPT;
+        }
+    }
+}
+
+void gdb_memory(vm_t *vm, char *packet, char *reply){
+    //m addr,length reads and M addr,length:data writes, guest memory never
+    //holds the ebreak of a breakpoint
+    unsigned int address, length;
+    uint32_t physical;
+    char *data = strchr(packet, ':');
+    if(sscanf(packet + 1, "%x,%x", &address, &length) != 2 || length > (GDB_PACKET_SIZE - 8) / 2 ||
+       (packet[0] == 'M' && data == NULL)){
+        sprintf(reply, "E01");
+        return;
+    }
+    for(unsigned int index = 0; index < length; index++){ //the range can cross into an unmapped page
+        if(!gdb_translate(vm, address + index, &physical) || (packet[0] == 'M' && host_map_read_only(physical))){
+            sprintf(reply, "E01");
+            return;
+        }
+    }
+
+    for(unsigned int index = 0; index < length; index++){
+        gdb_translate(vm, address + index, &physical);
+        if(packet[0] == 'M'){
+            unsigned int byte = 0;
+            sscanf(data + 1 + index * 2, "%2x", &byte);
+            vm->memory[physical] = byte;
+            vm->dirty[physical >> PAGE_SHIFT] = 1;
+        }
+        else{
+            sprintf(reply + index * 2, "%02x", vm->memory[physical]);
+        }
+    }
+    if(packet[0] == 'M'){
+        gdb_code_changed(vm);
+        sprintf(reply, "OK");
+    }
+}
+
+void gdb_swap_tables(void){
+    //watchpoints swap the load and store tables for checking versions, so
+    //without watchpoints loads and stores cost nothing extra
+    bool want = (gdb_watchpoint_count != 0);
+    if(want == gdb_tables_swapped){
+        return;
+    }
+    if(want){
+        memcpy(L_unwatched, L_functions, sizeof(L_functions));
+        memcpy(S_unwatched, S_functions, sizeof(S_functions));
+        memcpy(FL_unwatched, FL_functions, sizeof(FL_functions));
+        memcpy(FS_unwatched, FS_functions, sizeof(FS_functions));
+        for(int index = 0; index < 6; index++){
+            L_functions[index] = (L_unwatched[index] != NULL) ? watched_load : NULL;
+        }
+        for(int index = 0; index < 8; index++){
+            FL_functions[index] = (FL_unwatched[index] != NULL) ? watched_fp_load : NULL;
+            FS_functions[index] = (FS_unwatched[index] != NULL) ? watched_fp_store : NULL;
+        }
+        for(int index = 0; index < 3; index++){
+            S_functions[index] = watched_store;
+        }
+    }
+    else{
+        memcpy(L_functions, L_unwatched, sizeof(L_functions));
+        memcpy(S_functions, S_unwatched, sizeof(S_functions));
+        memcpy(FL_functions, FL_unwatched, sizeof(FL_functions));
+        memcpy(FS_functions, FS_unwatched, sizeof(FS_functions));
+    }
+    gdb_tables_swapped = want;
+}
+
+bool gdb_watch_hit(vm_t *vm, uint32_t address, uint32_t length, bool write){
+    for(int index = 0; index < gdb_watchpoint_count; index++){
+        gdb_watchpoint_t *watch = &gdb_watchpoints[index];
+        bool type_match = (watch->type == 4) || (watch->type == 2) == write;
+        if(type_match && watch->address < address + length && address < watch->address + watch->length){
+            vm->running = false; //the access completes, then the machine stops
+            vm->stop = STOP_WATCH;
+            vm->watch_address = watch->address;
+            vm->watch_type = watch->type;
+            return true;
+        }
+    }
+    return false;
+}
+
+int watched_load(vm_t *vm, instruction_t *ins){
+    gdb_watch_hit(vm, REG(ins->rs1) + ins->imm, 1 << (ins->funct3 & 0x3), false);
+    return L_unwatched[ins->funct3](vm, ins);
+}
+
+int watched_store(vm_t *vm, instruction_t *ins){
+    gdb_watch_hit(vm, REG(ins->rs1) + ins->imm, 1 << ins->funct3, true);
+    return S_unwatched[ins->funct3](vm, ins);
+}
+
+int watched_fp_load(vm_t *vm, instruction_t *ins){
+    //flw and fld use imm, vector loads cover vl elements from rs1
+    if(ins->funct3 == 2 || ins->funct3 == 3){
+        gdb_watch_hit(vm, REG(ins->rs1) + ins->imm, 1 << ins->funct3, false);
+    }
+    else{
+        gdb_watch_hit(vm, REG(ins->rs1), vm->vl << (ins->funct3 == 0 ? 0 : ins->funct3 - 4), false);
+    }
+    return FL_unwatched[ins->funct3](vm, ins);
+}
+
+int watched_fp_store(vm_t *vm, instruction_t *ins){
+    if(ins->funct3 == 2 || ins->funct3 == 3){
+        gdb_watch_hit(vm, REG(ins->rs1) + ins->imm, 1 << ins->funct3, true);
+    }
+    else{
+        gdb_watch_hit(vm, REG(ins->rs1), vm->vl << (ins->funct3 == 0 ? 0 : ins->funct3 - 4), true);
+    }
+    return FS_unwatched[ins->funct3](vm, ins);
+}
+
+void gdb_set_point(vm_t *vm, char *packet, char *reply){
+    //Z/z type,address,kind. 0 and 1 are breakpoints, both put ebreak in the
+    //fetch copy of the page. 2, 3 and 4 are write, read and access watchpoints
+    int type;
+    unsigned int address, length;
+    bool insert = (packet[0] == 'Z');
+    if(sscanf(packet + 1, "%d,%x,%x", &type, &address, &length) != 3 || type < 0 || type > 4){
+        reply[0] = '\0'; //not supported
+        return;
+    }
+
+    if(type <= 1){
+        gdb_breakpoint_t *breakpoint = gdb_find_breakpoint(address);
+        uint32_t physical;
+        if(address % 4 != 0 || (breakpoint == NULL && !gdb_translate(vm, address, &physical))){
+            sprintf(reply, "E01");
+            return;
+        }
+        if(insert && breakpoint == NULL){
+            if(gdb_breakpoint_count == GDB_MAX_BREAKPOINTS){
+                sprintf(reply, "E02");
+                return;
+            }
+            breakpoint = &gdb_breakpoints[gdb_breakpoint_count++];
+            breakpoint->address = address;
+            breakpoint->physical = physical;
+        }
+        else if(!insert && breakpoint != NULL){
+            *breakpoint = gdb_breakpoints[--gdb_breakpoint_count];
+        }
+        gdb_breakpoints_changed(vm);
+    }
+    else{
+        int index;
+        for(index = 0; index < gdb_watchpoint_count; index++){
+            if(gdb_watchpoints[index].address == address && gdb_watchpoints[index].length == length &&
+               gdb_watchpoints[index].type == type){
+                break;
+            }
+        }
+        if(insert && index == gdb_watchpoint_count){
+            if(gdb_watchpoint_count == GDB_MAX_WATCHPOINTS){
+                sprintf(reply, "E02");
+                return;
+            }
+            gdb_watchpoints[gdb_watchpoint_count++] = (gdb_watchpoint_t){address, length, type};
+        }
+        else if(!insert && index < gdb_watchpoint_count){
+            gdb_watchpoints[index] = gdb_watchpoints[--gdb_watchpoint_count];
+        }
+        gdb_swap_tables();
+    }
+    sprintf(reply, "OK");
+}
+
+void gdb_serve(vm_t *vm, instruction_t *ins){
+    //handles packets until the debugger detaches, kills or the program exits
+    static char reply[GDB_PACKET_SIZE];
+    char *packet;
+    struct sigaction action;
+
+    gdb_fd = gdb_open(gdb_address);
+    memset(&action, 0x00, sizeof(action));
+    action.sa_handler = gdb_sigio;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGIO, &action, NULL);
+    fcntl(gdb_fd, F_SETOWN, getpid());
+    fcntl(gdb_fd, F_SETFL, fcntl(gdb_fd, F_GETFL) | O_ASYNC);
+
+    vm->running = false;
+    vm->stop = STOP_BREAKPOINT;
+    while((packet = gdb_read_packet()) != NULL){
+        reply[0] = '\0';
+        if(packet[0] == '?'){
+            gdb_stop_reply(vm, reply);
+        }
+        else if(packet[0] == 'g'){
+            for(int index = 0; index < 33; index++){
+                gdb_hex_u32(reply + index * 8, (index == REG_ZERO) ? 0 : vm->registers[index]);
+            }
+        }
+        else if(packet[0] == 'G' && strlen(packet + 1) >= 33 * 8){
+            for(int index = 1; index < PC_REG; index++){
+                vm->registers[index] = gdb_parse_u32(packet + 1 + index * 8);
+            }
+            gdb_set_pc(vm, gdb_parse_u32(packet + 1 + PC_REG * 8));
+            sprintf(reply, "OK");
+        }
+        else if(packet[0] == 'p'){
+            unsigned int reg = strtoul(packet + 1, NULL, 16);
+            if(reg < 33){
+                gdb_hex_u32(reply, (reg == REG_ZERO) ? 0 : vm->registers[reg]);
+            }
+            else{
+                sprintf(reply, "E01");
+            }
+        }
+        else if(packet[0] == 'P'){
+            char *value = strchr(packet, '=');
+            unsigned int reg = strtoul(packet + 1, NULL, 16);
+            if(value != NULL && reg < 33 && strlen(value + 1) >= 8){
+                if(reg == PC_REG){
+                    gdb_set_pc(vm, gdb_parse_u32(value + 1));
+                }
+                else if(reg != REG_ZERO){
+                    vm->registers[reg] = gdb_parse_u32(value + 1);
+                }
+                sprintf(reply, "OK");
+            }
+            else{
+                sprintf(reply, "E01");
+            }
+        }
+        else if(packet[0] == 'm' || packet[0] == 'M'){
+            gdb_memory(vm, packet, reply);
+        }
+        else if(packet[0] == 'c' || packet[0] == 's'){
+            if(packet[1] != '\0'){ //resume at a new address
+                gdb_set_pc(vm, strtoul(packet + 1, NULL, 16));
+            }
+            gdb_resume(vm, ins, packet[0] == 's');
+            gdb_stop_reply(vm, reply);
+            if(vm->stop == STOP_NONE){ //exited, nothing left to debug
+                gdb_send_packet(reply);
+                break;
+            }
+        }
+        else if(packet[0] == 'Z' || packet[0] == 'z'){
+            gdb_set_point(vm, packet, reply);
+        }
+        else if(packet[0] == 'k'){
+            vm->running = false;
+            break;
+        }
+        else if(packet[0] == 'D'){
+            gdb_send_packet("OK");
+            vm->running = true;
+            break;
+        }
+        else if(strncmp(packet, "qSupported", 10) == 0){
+            sprintf(reply, "PacketSize=%x;qXfer:features:read+;swbreak+;hwbreak+", GDB_PACKET_SIZE - 8);
+        }
+        else if(strncmp(packet, "qXfer:features:read:target.xml:", 31) == 0){
+            unsigned int offset = 0, length = 0;
+            unsigned int size = sizeof(gdb_target_xml) - 1;
+            sscanf(packet + 31, "%x,%x", &offset, &length);
+            if(length > GDB_PACKET_SIZE - 16){
+                length = GDB_PACKET_SIZE - 16;
+            }
+            if(offset >= size){
+                sprintf(reply, "l");
+            }
+            else{
+                unsigned int count = (size - offset < length) ? size - offset : length;
+                reply[0] = (offset + count < size) ? 'm' : 'l';
+                memcpy(reply + 1, gdb_target_xml + offset, count);
+                reply[count + 1] = '\0';
+            }
+        }
+        else if(strcmp(packet, "qAttached") == 0){
+            sprintf(reply, "1");
+        }
+        else if(packet[0] == 'H'){
+            sprintf(reply, "OK");
+        }
+        gdb_send_packet(reply);
+    }
+
+    //detached or disconnected, the program continues without breakpoints
+    gdb_breakpoint_count = 0;
+    gdb_breakpoints_changed(vm);
+    gdb_watchpoint_count = 0;
+    gdb_swap_tables();
+    close(gdb_fd);
+    gdb_fd = -1;
+    if(packet == NULL && vm->stop != STOP_NONE){
+        vm->running = true;
+    }
+    gdb_address = NULL; //ebreak is ecall again
+}
+
+static inline uint32_t lanes_min(const lanes_u32 *lanes){
+    //horizontal minimum in log2(BATCH_WIDTH) shuffle steps
+# if defined(__clang__)
+    return __builtin_reduce_min(*lanes);
+# else
+    lanes_u32 v = *lanes;
+    lanes_u32 index;
+    for(int lane = 0; lane < BATCH_WIDTH; lane++){
+        index[lane] = lane;
+    }
+    for(int step = BATCH_WIDTH / 2; step > 0; step /= 2){
+        lanes_u32 swapped = __builtin_shuffle(v, index ^ step);
+        lanes_u32 less = (lanes_u32)(swapped < v);
+        v = (swapped & less) | (v & ~less);
+    }
+    return v[0];
+# endif
+}
+
+static inline bool lanes_any(const lanes_u32 *lanes){
+    //true when any lane is non zero
+    uint64_t words[BATCH_WIDTH / 2];
+    uint64_t any = 0;
+    memcpy(words, lanes, sizeof(words));
+    for(int index = 0; index < BATCH_WIDTH / 2; index++){
+        any |= words[index];
+    }
+    return any != 0;
+}
+
+void run_batch(uint8_t *disk, long signed size, char **inputs, int lanes, uint32_t input_address){
+    //every lane gets the image and its own input file at input_address, the
+    //lanes execute in lockstep and the registers of each lane are saved in
+    //vm_out_<lane>.res when it exits
+    batch_t batch_vm;
+    batch_t *batch = &batch_vm;
+    memset(batch, 0x00, sizeof(*batch));
+    batch->lanes = lanes;
+    batch->chunks = (lanes + BATCH_WIDTH - 1) / BATCH_WIDTH;
+    batch->registers = aligned_alloc(sizeof(lanes_u32), 33 * batch->chunks * sizeof(lanes_u32));
+    batch->active = aligned_alloc(sizeof(lanes_u32), batch->chunks * sizeof(lanes_u32));
+    batch->decoded = calloc(mem_size / 4, sizeof(instruction_t));
+    //padding lanes get a memory as well, so loads and stores can touch every lane of a chunk
+    size_t memory_size = (size_t)batch->chunks * BATCH_WIDTH * BATCH_STRIDE;
+    batch->memory = mmap(NULL, memory_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(batch->registers == NULL || batch->active == NULL || batch->decoded == NULL || batch->memory == MAP_FAILED){
+        perror("Batch allocation error");
+        exit(1);
+    }
+    memset(batch->registers, 0x00, 33 * batch->chunks * sizeof(lanes_u32));
+    for(int lane = lanes; lane < batch->chunks * BATCH_WIDTH; lane++){
+        LANE(PC_REG, lane) = UINT32_MAX; //padding lanes never run
+    }
+
+    for(int lane = 0; lane < lanes; lane++){
+        uint8_t *memory = batch->memory + (size_t)lane * BATCH_STRIDE;
+        memcpy(memory, disk, size);
+
+        struct stat st;
+        FILE *fp = fopen(inputs[lane], "rb");
+        if(fp == NULL || fstat(fileno(fp), &st) != 0){
+            perror(inputs[lane]);
+            exit(1);
+        }
+        if((uint64_t)input_address + st.st_size > mem_size){
+            fprintf(stderr, "Batch: %s does not fit in memory at %#x\n", inputs[lane], input_address);
+            exit(1);
+        }
+        if(fread(memory + input_address, 1, st.st_size, fp) != (size_t)st.st_size){
+            perror("Batch input read error");
+            exit(1);
+        }
+        fclose(fp);
+    }
+
+    //lanes on the lowest PC run first, so lanes that diverged at a branch
+    //wait until the others reach the same PC and then run together again
+    lanes_u32 lowest = LANES(PC_REG, 0);
+    for(int c = 1; c < batch->chunks; c++){
+        lanes_u32 less = (lanes_u32)(LANES(PC_REG, c) < lowest);
+        lowest = (LANES(PC_REG, c) & less) | (lowest & ~less);
+    }
+    uint32_t group_PC = lanes_min(&lowest);
+
+    while(group_PC != UINT32_MAX){ //UINT32_MAX when all lanes exited
+        //the lowest PC of the waiting lanes, the group stops there so they join it
+        lanes_u32 waiting = (lanes_u32){0} + UINT32_MAX;
+        batch->chunk_begin = batch->chunks;
+        batch->chunk_end = 0;
+        for(int c = 0; c < batch->chunks; c++){
+            batch->active[c] = (lanes_u32)(LANES(PC_REG, c) == group_PC);
+            lanes_u32 other = LANES(PC_REG, c) | batch->active[c];
+            lanes_u32 less = (lanes_u32)(other < waiting);
+            waiting = (other & less) | (waiting & ~less);
+            if(lanes_any(&batch->active[c])){
+                batch->chunk_begin = (c < batch->chunk_begin) ? c : batch->chunk_begin;
+                batch->chunk_end = c + 1;
+            }
+        }
+        uint32_t join_PC = lanes_min(&waiting);
+        int first_lane = batch->chunk_begin * BATCH_WIDTH;
+        while(!LANE_ACTIVE(first_lane)){
+            first_lane++;
+        }
+
+        //the group runs straight line code until it branches, halts or reaches a waiting lane
+        instruction_t *ins;
+        do{
+            if(group_PC % 4 != 0){
+                fprintf(stderr, "Memory alignment error.");
+                exit(1);
+            }
+            //all lanes run the same image, fetch from the first active lane and decode each word once
+            uint8_t *code = lane_memory(batch, first_lane, group_PC, 4);
+            ins = &batch->decoded[group_PC / 4];
+            if(ins->opcode == 0){
+                ins->machinecode = code[0] | code[1] << 8 | code[2] << 16 | (uint32_t)code[3] << 24;
+                decode(ins);
+            }
+            batch_step(batch, ins);
+
+            if(ins->rd == REG_ZERO){
+                for(int c = batch->chunk_begin; c < batch->chunk_end; c++){
+                    LANES(REG_ZERO, c) = (lanes_u32){0};
+                }
+            }
+            if(batch->branch){
+                batch->branch = false;
+                break;
+            }
+            for(int c = batch->chunk_begin; c < batch->chunk_end; c++){
+                LANES(PC_REG, c) += batch->active[c] & 4;
+            }
+            group_PC += 4;
+        }while(group_PC < join_PC && ins->opcode != 0x73); //an ecall may halt lanes of the group
+
+        //only the lanes of the group moved, so the next lowest PC is one of
+        //theirs or the lowest of the waiting lanes
+        lowest = (lanes_u32){0} + join_PC;
+        for(int c = batch->chunk_begin; c < batch->chunk_end; c++){
+            lanes_u32 moved = LANES(PC_REG, c) | ~batch->active[c];
+            lanes_u32 less = (lanes_u32)(moved < lowest);
+            lowest = (moved & less) | (lowest & ~less);
+        }
+        group_PC = lanes_min(&lowest);
+    }
+
+    munmap(batch->memory, memory_size);
+    free(batch->registers);
+    free(batch->active);
+    free(batch->decoded);
+}
+
+void batch_step(batch_t *batch, instruction_t *ins){
+    if(ins->opcode == 0x33){
+        Batch_R_functions[ins->funct3][ins->f7_index](batch, ins);
+    }
+    else if(ins->opcode == 0x13){
+        Batch_I_functions[ins->funct3][ins->f7_index](batch, ins);
+    }
+    else if(ins->opcode == 0x37){
+        batch_lui(batch, ins);
+    }
+    else if(ins->opcode == 0x17){
+        batch_auipc(batch, ins);
+    }
+    else if(ins->opcode == 0x23){
+        batch_store(batch, ins);
+    }
+    else if(ins->opcode == 0x03){
+        batch_load(batch, ins);
+    }
+    else if(ins->opcode == 0x63){
+        Batch_B_functions[ins->funct3](batch, ins);
+    }
+    else if(ins->opcode == 0x6F){
+        batch_jal(batch, ins);
+    }
+    else if(ins->opcode == 0x67){
+        batch_jalr(batch, ins);
+    }
+    else if(ins->opcode == 0x73 && ins->funct3 == 0){
+        batch_ecall(batch, ins);
+    }
+    else{
+        fprintf(stderr, "Batch: unsupported instruction %#010x\n", ins->machinecode);
+        exit(100);
+    }
+}
+
+uint8_t *lane_memory(batch_t *batch, int lane, uint32_t address, int size){
+    if(address > (uint32_t)(mem_size - size)){ //a lane must never touch the memory of another lane
+        fprintf(stderr, "Batch: lane %d address %#x out of memory\n", lane, address);
+        exit(1);
+    }
+    return batch->memory + (size_t)lane * BATCH_STRIDE + address;
+}
+
+//only the active lanes get the result, the others keep their value
+# define BATCH_R_TYPE(name, expr) \
+int batch_##name(batch_t *batch, instruction_t *ins){ \
+    for(int c = batch->chunk_begin; c < batch->chunk_end; c++){ \
+        lanes_u32 a = LANES(ins->rs1, c); \
+        lanes_u32 b = LANES(ins->rs2, c); \
+        lanes_u32 mask = batch->active[c]; \
+        LANES(ins->rd, c) = ((expr) & mask) | (LANES(ins->rd, c) & ~mask); \
+    } \
+    return 0; \
+}
+
+# define BATCH_I_TYPE(name, expr) \
+int batch_##name(batch_t *batch, instruction_t *ins){ \
+    lanes_u32 b = (lanes_u32){0} + (uint32_t)ins->imm; \
+    for(int c = batch->chunk_begin; c < batch->chunk_end; c++){ \
+        lanes_u32 a = LANES(ins->rs1, c); \
+        lanes_u32 mask = batch->active[c]; \
+        LANES(ins->rd, c) = ((expr) & mask) | (LANES(ins->rd, c) & ~mask); \
+    } \
+    return 0; \
+}
+
+# define BATCH_BRANCH(name, condition) \
+int batch_##name(batch_t *batch, instruction_t *ins){ \
+    for(int c = batch->chunk_begin; c < batch->chunk_end; c++){ \
+        lanes_u32 a = LANES(ins->rs1, c); \
+        lanes_u32 b = LANES(ins->rs2, c); \
+        lanes_u32 pc = LANES(PC_REG, c); \
+        lanes_u32 taken = (lanes_u32)(condition); \
+        lanes_u32 next = ((pc + (uint32_t)ins->imm) & taken) | ((pc + 4) & ~taken); \
+        LANES(PC_REG, c) = (next & batch->active[c]) | (pc & ~batch->active[c]); \
+    } \
+    batch->branch = true; \
+    return 0; \
+}
+
+BATCH_R_TYPE(add, a + b)
+BATCH_R_TYPE(sub, a - b)
+BATCH_R_TYPE(xor, a ^ b)
+BATCH_R_TYPE(or, a | b)
+BATCH_R_TYPE(and, a & b)
+BATCH_R_TYPE(sll, a << (b & MASK_5_BIT))
+BATCH_R_TYPE(srl, a >> (b & MASK_5_BIT))
+BATCH_R_TYPE(sra, (lanes_u32)((lanes_s32)a >> (lanes_s32)(b & MASK_5_BIT)))
+BATCH_R_TYPE(slt, (lanes_u32)((lanes_s32)a < (lanes_s32)b) & 1)
+BATCH_R_TYPE(sltu, (lanes_u32)(a < b) & 1)
+
+BATCH_I_TYPE(addi, a + b)
+BATCH_I_TYPE(xori, a ^ b)
+BATCH_I_TYPE(ori, a | b)
+BATCH_I_TYPE(andi, a & b)
+BATCH_I_TYPE(slli, a << (b & MASK_5_BIT))
+BATCH_I_TYPE(srli, a >> (b & MASK_5_BIT))
+BATCH_I_TYPE(srai, (lanes_u32)((lanes_s32)a >> (lanes_s32)(b & MASK_5_BIT)))
+BATCH_I_TYPE(slti, (lanes_u32)((lanes_s32)a < (lanes_s32)b) & 1)
+BATCH_I_TYPE(sltiu, (lanes_u32)(a < b) & 1)
+
+BATCH_BRANCH(beq, a == b)
+BATCH_BRANCH(bne, a != b)
+BATCH_BRANCH(blt, (lanes_s32)a < (lanes_s32)b)
+BATCH_BRANCH(bge, (lanes_s32)a >= (lanes_s32)b)
+BATCH_BRANCH(bltu, a < b)
+BATCH_BRANCH(bgeu, a >= b)
+
+int batch_lui(batch_t *batch, instruction_t *ins){
+    for(int c = batch->chunk_begin; c < batch->chunk_end; c++){
+        lanes_u32 mask = batch->active[c];
+        LANES(ins->rd, c) = (((uint32_t)ins->imm << 12) & mask) | (LANES(ins->rd, c) & ~mask);
+    }
+    return 0;
+}
+
+int batch_auipc(batch_t *batch, instruction_t *ins){
+    for(int c = batch->chunk_begin; c < batch->chunk_end; c++){
+        lanes_u32 mask = batch->active[c];
+        lanes_u32 value = LANES(PC_REG, c) + ((uint32_t)ins->imm << 12);
+        LANES(ins->rd, c) = (value & mask) | (LANES(ins->rd, c) & ~mask);
+    }
+    return 0;
+}
+
+int batch_jal(batch_t *batch, instruction_t *ins){
+    for(int c = batch->chunk_begin; c < batch->chunk_end; c++){
+        lanes_u32 mask = batch->active[c];
+        lanes_u32 pc = LANES(PC_REG, c);
+        LANES(ins->rd, c) = ((pc + 4) & mask) | (LANES(ins->rd, c) & ~mask);
+        LANES(PC_REG, c) = ((pc + (uint32_t)ins->imm) & mask) | (pc & ~mask);
+    }
+    batch->branch = true;
+    return 0;
+}
+
+int batch_jalr(batch_t *batch, instruction_t *ins){
+    for(int c = batch->chunk_begin; c < batch->chunk_end; c++){
+        lanes_u32 mask = batch->active[c];
+        lanes_u32 pc = LANES(PC_REG, c);
+        lanes_u32 target = (LANES(ins->rs1, c) + (uint32_t)ins->imm) & ~1u; //before rd, rd may be rs1
+        LANES(ins->rd, c) = ((pc + 4) & mask) | (LANES(ins->rd, c) & ~mask);
+        LANES(PC_REG, c) = (target & mask) | (pc & ~mask);
+    }
+    batch->branch = true;
+    return 0;
+}
+
+void batch_address(batch_t *batch, instruction_t *ins, int size, int c, lanes_u32 *address){
+    //guest addresses of one chunk, inactive lanes get address 0 so every lane can be accessed
+    *address = (LANES(ins->rs1, c) + (uint32_t)ins->imm) & batch->active[c];
+    lanes_u32 outside = (lanes_u32)(*address > (uint32_t)(mem_size - size));
+    for(int index = 0; lanes_any(&outside); index++){ //a lane must never touch the memory of another lane
+        if(outside[index]){
+            fprintf(stderr, "Batch: lane %d address %#x out of memory\n", c * BATCH_WIDTH + index, (*address)[index]);
+            exit(1);
+        }
+    }
+}
+
+int batch_load(batch_t *batch, instruction_t *ins){
+    //memory is private to each lane, so only the accesses are done lane by lane,
+    //the addresses, sign extension and merge are vector ops
+    int size = 1 << (ins->funct3 & 0x3);
+    if(ins->funct3 == 3 || ins->funct3 > 5){
+        fprintf(stderr, "Batch: unknown load funct3=%i\n", ins->funct3);
+        exit(1);
+    }
+    for(int c = batch->chunk_begin; c < batch->chunk_end; c++){
+        lanes_u32 address;
+        batch_address(batch, ins, size, c, &address);
+        uint8_t *memory = batch->memory + (size_t)c * BATCH_WIDTH * BATCH_STRIDE;
+        lanes_u32 value;
+        for(int index = 0; index < BATCH_WIDTH; index++){
+            uint8_t *data = memory + (size_t)index * BATCH_STRIDE + address[index];
+            if(size == 1){
+                value[index] = data[0];
+            }
+            else if(size == 2){
+                value[index] = *(uint16_t *)data;
+            }
+            else{
+                value[index] = *(uint32_t *)data;
+            }
+        }
+        if(ins->funct3 == 0){ //lb
+            value = (lanes_u32)((lanes_s32)(value << 24) >> 24);
+        }
+        else if(ins->funct3 == 1){ //lh
+            value = (lanes_u32)((lanes_s32)(value << 16) >> 16);
+        }
+        lanes_u32 mask = batch->active[c];
+        LANES(ins->rd, c) = (value & mask) | (LANES(ins->rd, c) & ~mask);
+    }
+    return 0;
+}
+
+int batch_store(batch_t *batch, instruction_t *ins){
+    int size = 1 << (ins->funct3 & 0x3);
+    for(int c = batch->chunk_begin; c < batch->chunk_end; c++){
+        lanes_u32 address;
+        batch_address(batch, ins, size, c, &address);
+        lanes_u32 value = LANES(ins->rs2, c);
+        uint8_t *memory = batch->memory + (size_t)c * BATCH_WIDTH * BATCH_STRIDE;
+        for(int index = 0; index < BATCH_WIDTH; index++){
+            if(batch->active[c][index]){ //little endian host, low bytes first
+                memcpy(memory + (size_t)index * BATCH_STRIDE + address[index], &value[index], size);
+            }
+        }
+    }
+    return 0;
+}
+
+int batch_ecall(batch_t *batch, instruction_t *ins){
+    (void)ins;
+    char file_name[32];
+    uint32_t registers[32];
+
+    for(int lane = 0; lane < batch->lanes; lane++){
+        if(!LANE_ACTIVE(lane) || (LANE(17, lane) != 10 && LANE(10, lane) != 10)){
+            continue;
+        }
+        for(int index = 0; index < 32; index++){
+            registers[index] = LANE(index, lane);
+        }
+        snprintf(file_name, sizeof(file_name), "vm_out_%d.res", lane);
+        FILE *fp = fopen(file_name, "wb");
+        if(fp == NULL || fwrite(registers, sizeof(uint32_t), 32, fp) != 32){
+            fprintf(stderr, "Batch ecall: could not write %s\n", file_name);
+            exit(1);
+        }
+        fclose(fp);
+        LANE(PC_REG, lane) = UINT32_MAX - 4; //halted, the +4 below gives UINT32_MAX
+    }
+    return 0;
+}
@@ -0,0 +1,39 @@
+# batch mode, run with the arguments in batch.args. Every lane counts the
+# Collatz steps of the word at 0x10000, so the lanes diverge at each branch
+  lui s0, 0x10
+  lw t0, 0(s0)
+  li s1, 0
+  li t3, 1
+loop:
+  beq t0, t3, done
+  andi t1, t0, 1
+  beqz t1, even
+  slli t2, t0, 1
+  add t0, t0, t2
+  addi t0, t0, 1
+  j next
+even:
+  srli t0, t0, 1
+next:
+  addi s1, s1, 1
+  j loop
+done:
+  sw s1, 4(s0)          # steps
+  lw s2, 4(s0)
+  lb s3, 8(s0)          # sign and zero extension of the lane pattern at 0x10008
+  lbu s4, 8(s0)
+  lh s5, 8(s0)
+  lhu s6, 10(s0)
+  sb s1, 12(s0)
+  sh s1, 14(s0)
+  lw s7, 12(s0)
+  jal ra, twice         # jal and jalr per lane
+  mv s8, a0
+  sub s9, zero, s1
+  sra s10, s9, t3
+  sltu s11, s9, s1
+  li a7, 10
+  ecall
+twice:
+  add a0, s1, s1
+  jalr zero, 0(ra)
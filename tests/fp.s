@@ -0,0 +1,74 @@
+# F and D rounding modes, fflags and fcvt edge cases. Every result is moved
+# to an integer register, fsflags reads and clears the flags after each case
+  li t0, 0x40200000      # 2.5
+  fmv.w.x f1, t0
+  li t0, 0xc0200000      # -2.5
+  fmv.w.x f2, t0
+  fcvt.w.s s0, f1, rne   # 2, ties to even
+  fcvt.w.s s1, f2, rdn   # -3
+  fcvt.w.s s2, f2, rup   # -2
+  fcvt.w.s s3, f1, rmm   # 3, ties away from zero
+  fcvt.w.s s4, f2, rtz   # -2
+  fsflags s5, zero       # NX (0x01)
+
+  li t0, 0x3f8ccccd      # 1.1
+  fmv.w.x f3, t0
+  fsrmi 3                # dynamic rounding mode RUP
+  fcvt.w.s s6, f3        # 2
+  frrm s7                # 3
+  fsrmi 0
+
+  li t0, 1
+  fcvt.s.w f4, t0
+  li t0, 3
+  fcvt.s.w f5, t0
+  fdiv.s f6, f4, f5, rup # 1/3 rounded up and down differ by one ulp
+  fdiv.s f7, f4, f5, rdn
+  fmv.x.w t1, f6
+  fmv.x.w t2, f7
+  sub s8, t1, t2         # 1
+  fsflags zero, zero
+
+  fmv.w.x f8, zero
+  fdiv.s f9, f4, f8      # 1/0
+  fsflags s9, zero       # DZ (0x08)
+  fmv.x.w s10, f9        # +inf 0x7f800000
+  fneg.s f10, f4
+  fsqrt.s f11, f10       # sqrt(-1)
+  fsflags s11, zero      # NV (0x10)
+  fmv.x.w a0, f11        # canonical NaN 0x7fc00000
+  li t0, 0x7f7fffff      # largest float
+  fmv.w.x f12, t0
+  fadd.s f13, f12, f12
+  fsflags a1, zero       # OF and NX (0x05)
+
+  fcvt.w.s a2, f11       # NaN converts to 0x7fffffff
+  li t0, 0x4f32d05e      # 3e9
+  fmv.w.x f14, t0
+  fcvt.w.s a3, f14       # 0x7fffffff
+  fneg.s f15, f14
+  fcvt.w.s a4, f15       # 0x80000000
+  fcvt.wu.s a5, f10      # -1 to unsigned is 0
+  fsflags a6, zero       # NV (0x10)
+  li t0, 0xbf000000      # -0.5
+  fmv.w.x f16, t0
+  fcvt.wu.s sp, f16, rtz # 0, only inexact
+  fsflags t3, zero       # NX (0x01)
+
+  li t0, 16777217        # 2^24 + 1 is not a float
+  fcvt.s.w f17, t0, rne
+  fcvt.s.w f18, t0, rup
+  fmv.x.w t4, f17        # 16777216 0x4b800000
+  fmv.x.w t5, f18        # 16777218 0x4b800001
+  li t0, 0x7fffffff
+  fcvt.d.w f19, t0
+  li t0, 0x3f000000      # 0.5
+  fmv.w.x f20, t0
+  fcvt.d.s f21, f20
+  fadd.d f22, f19, f21   # 2147483647.5
+  fcvt.w.d t6, f22, rdn  # 2147483647
+  fcvt.w.d gp, f22, rne  # rounds to 2^31, clamps to 0x7fffffff
+  fsflags tp, zero       # NX and NV (0x11)
+  frcsr ra               # 0, the flags are clear and frm is RNE
+  li a7, 10
+  ecall
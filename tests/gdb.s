@@ -0,0 +1,13 @@
+# gdb smoke test, driven by the packets in gdb.gdb: a breakpoint in the
+# loop, register and memory access, a single step, a write watchpoint and
+# a detach that lets the program run to the end
+  li t0, 0
+  li t1, 3
+loop:
+  addi t0, t0, 1            # breakpoint at 0x8
+  bne t0, t1, loop
+  li t2, 0x8000
+  lw s2, 0(t2)              # 0x12345678, written by the debugger
+  sw s2, 4(t2)              # watched
+  li a7, 10
+  ecall
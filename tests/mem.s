@@ -0,0 +1,25 @@
+# --dump-mem golden (mem.mem): only the pages written by the program are
+# dumped, the last store of each address wins
+  li t0, 0x8000
+  li t1, 0x11223344
+  sw t1, 0(t0)
+  li t2, 0x8ffc
+  sw t1, 0(t2)               # last word of the page
+  sb t1, 0x100(t0)
+  sb zero, 0x100(t0)         # rewritten with 0, the page stays dirty
+  li t0, 0xa000
+  sh t1, 0x7fe(t0)
+  li t0, 0x20000             # fill a page with index * 7
+  li t2, 0
+  li t3, 1024
+fill:
+  slli t4, t2, 3
+  sub t4, t4, t2
+  slli t5, t2, 2
+  add t5, t5, t0
+  sw t4, 0(t5)
+  addi t2, t2, 1
+  bne t2, t3, fill
+  lw s2, 0(t5)               # 1023 * 7
+  li a7, 10
+  ecall
@@ -0,0 +1,66 @@
+# RVV with VLEN=128: vsetvl/vl, reductions over a vector group and the
+# tail, and SEW=64 shifts including shift amounts past 63
+  li a0, 100
+  vsetvli s0, a0, e32, m1, ta, ma   # 4, VLMAX
+  vsetvli s1, a0, e8, m8, ta, ma    # 100, below VLMAX
+  vsetivli s2, 3, e16, m1, ta, ma   # 3
+  vsetvli s3, zero, e16, m2, ta, ma # 16, rs1 = x0 asks for VLMAX
+  li t0, 0x20                       # reserved SEW=128
+  vsetvl s4, a0, t0                 # 0, vill
+  csrr s5, vtype                    # 0x80000000
+  csrr s6, vlenb                    # 16
+
+  la a1, words
+  vsetivli t0, 8, e32, m2, ta, ma
+  vle32.v v2, (a1)
+  li t1, 10
+  vmv.s.x v1, t1
+  vredsum.vs v4, v2, v1
+  vmv.x.s s7, v4                    # 10 + sum of the words
+  vredmin.vs v4, v2, v1
+  vmv.x.s s8, v4                    # 0x80000000
+  vredmaxu.vs v4, v2, v1
+  vmv.x.s s9, v4                    # 0xffffffff
+  vredxor.vs v4, v2, v1
+  vmv.x.s s10, v4
+  vsetivli t0, 5, e32, m2, tu, mu
+  vredsum.vs v4, v2, v1
+  vmv.x.s s11, v4                   # only the first 5 words
+
+  la a1, dwords
+  li a2, 0x8000
+  vsetivli t0, 2, e64, m1, ta, ma
+  vle64.v v8, (a1)
+  vsll.vi v9, v8, 31
+  vse64.v v9, (a2)
+  li t1, 33
+  vsrl.vx v10, v8, t1
+  addi a3, a2, 16
+  vse64.v v10, (a3)
+  la a1, amounts
+  vle64.v v11, (a1)
+  vsra.vv v12, v8, v11              # shift amounts use the low 6 bits only
+  addi a3, a2, 32
+  vse64.v v12, (a3)
+  lw a4, 0(a2)
+  lw a5, 4(a2)
+  lw a6, 8(a2)
+  lw t2, 12(a2)
+  lw t3, 16(a2)
+  lw t4, 20(a2)
+  lw t5, 24(a2)
+  lw t6, 28(a2)
+  lw gp, 32(a2)
+  lw tp, 36(a2)
+  lw ra, 40(a2)
+  lw sp, 44(a2)
+  li a7, 10
+  ecall
+
+  .p2align 3
+words:
+  .word 5, -3, 7, 0x80000000, 2, 9, -1, 4
+dwords:
+  .dword 0x8000000000000001, 0x00000000ffffffff
+amounts:
+  .dword 63, 68